@@ -1,18 +1,34 @@
 /*
  * ftrace_log -- Pull trace_pipe and save to disk
  *
- * Compile: gcc -g -o ftrace_log ftrace_log.c -Wall
+ * Compile: gcc -g -pthread -o ftrace_log ftrace_log.c -Wall -lz
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
 #include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <stdint.h>
+#include <dirent.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <zlib.h>
 #include <linux/limits.h>
+#include <linux/io_uring.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -28,181 +44,3051 @@
                 fprintf(stdout, (fmt) , ##args );               \
 } while (0)
 
-#define MAX_LOGS 10
+#define NR_LOGS 10
+#define MAX_LOGS 100000
+
+#define RAW_SPLICE_SZ   (1 << 20)       /* Bytes per splice() from ring buffer */
+#define STATS_INTERVAL  10              /* Seconds between lost event reports */
+#define RAW_POLL_MS     100             /* Raw readers check stop this often */
+#define GZ_BUF_SZ       (1 << 20)       /* zlib input/output buffer */
+#define TBUF_SZ         (1 << 20)       /* Bytes of a trace buffer */
+#define NR_TBUFS        64              /* Default trace buffers in pool */
+#define READ_MIN        (64 << 10)      /* Hand over a buffer with less room */
+#define FLUSH_MS        100             /* Hand over a partial buffer when idle */
+#define TS_MAX          64              /* Bytes of a timestamp prefix */
+#define SEG_MAGIC       "FTLSEG1"       /* Trailer of a segment file */
+#define SEG_BLOCK_KB    256             /* Default text bytes per block */
+#define SEG_COMPRESSED  0x1
+#define AGG_HASH_SZ     1024            /* Slots of event hash, power of 2 */
+#define AGG_INTERVAL    60              /* Default seconds between summaries */
+#define AGG_BUCKETS     65              /* log2 histogram: 0, [1, 2), ... */
+#define CTL_VAL_MAX     4096            /* Bytes of a tracefs setting */
+#define AUTO_SECS       4               /* Seconds of peak rate to buffer */
+#define AUTO_MAX_KB     (256 << 10)     /* Default cap of auto buffer size */
+#define METRICS_INTERVAL 5              /* Seconds between stats file updates */
+#define WBUF_SZ         (4 << 20)       /* Bytes per write to the log */
+#define NR_WBUFS        4               /* Writes in flight */
+#define WBUF_ALIGN      4096            /* O_DIRECT alignment */
+#define LOG_SYNC_SECS   1               /* Max seconds log data waits in memory */
 
 const char *prog = "ftrace_log";
 const char *pidfile = "/run/ftrace_log.pid";
 int pidfile_fd;
 
-size_t max_filesz = 100 << 20;          /* Log file size, Default: 100M */
-unsigned long nr_logs = MAX_LOGS;       /* Number of logfile */
-char log_path[PATH_MAX] = "/var/log/ftrace";/* Path of log file */
-char log_file[PATH_MAX];                /* Log file with full path */
-char compress_cmd[PATH_MAX] = "/bin/gzip"; /* Command for compress */
-char *ftrace_pipe = "/sys/kernel/debug/tracing/trace_pipe";     /* Ftrace pipe file */
-FILE *ftrace_fp;                        /* Read fp, trace_pipe */
-FILE *log_fp;                           /* Write fp */
-int timestamp = 0;                      /* Add timetamp to log file or no */
-char *suffix = "gz";                    /* Suffix for compression */
-int compress = 1;                       /* Flag of compress, default: Enabled */
-int debug_level = WARN;                 /* Debug level */
-int forground = 0;
+size_t max_filesz = 100 << 20;          /* Log file size, Default: 100M */
+unsigned long nr_logs = NR_LOGS;        /* Number of logfile */
+size_t retain_bytes;                    /* Max bytes of rotated logs, -R */
+unsigned long retain_secs;              /* Max age of rotated logs, -A */
+unsigned long rotate_secs;              /* Rotate interval, -i */
+char log_path[PATH_MAX] = "/var/log/ftrace";/* Path of log file */
+char log_file[PATH_MAX];                /* Log file with full path */
+char tracing_dir[PATH_MAX] = "/sys/kernel/debug/tracing";      /* Tracefs mount */
+char ftrace_pipe[PATH_MAX];             /* Ftrace pipe file */
+int ftrace_fd = -1;                     /* Read fd, trace_pipe */
+/* Timestamp prefix of each line */
+#define TS_NONE         0
+#define TS_WALL         1               /* -t: wallclock when line is read */
+#define TS_EVENT        2               /* -e: trace timestamp + boot offset */
+#define TS_CTIME        3               /* time() + ctime() per line, -B baseline */
+
+int timestamp = TS_NONE;                /* Add timetamp to log file or no */
+char *suffix = ".gz";                   /* Suffix for compression */
+int do_compress = 1;                    /* Flag of compress, default: Enabled */
+int compress_level = Z_DEFAULT_COMPRESSION;
+double last_rotate;                     /* Time of open or last rotation */
+int use_uring = 0;                      /* Submit log writes with io_uring */
+int use_direct = 0;                     /* Open log with O_DIRECT */
+int debug_level = WARN;                 /* Debug level */
+int forground = 0;
+int raw_mode = 0;                       /* Splice per-cpu trace_pipe_raw */
+volatile sig_atomic_t stop = 0;         /* Got a signal, stop reading */
+
+/*
+ * Retention: a rotated log is named file.<seq>.<YYYYmmdd-HHMMSS><sfx>,
+ * so rotation is one rename plus unlinking the oldest files that fall
+ * out of -n/-R/-A, never a shift of every older file. The rotated files
+ * of a log are kept in a ring, oldest first, rebuilt from log_path on
+ * start.
+ */
+struct rlog {
+        unsigned long seq;
+        time_t time;
+        size_t size;
+};
+
+struct retain {
+        struct rlog *e;
+        unsigned long head, nr, cap;
+        unsigned long next_seq;
+        size_t bytes;                   /* Sum of sizes */
+};
+
+struct retain text_retain;
+
+/*
+ * Raw capture: one reader per cpu moves ring buffer pages from
+ * per_cpu/cpuN/trace_pipe_raw to ftrace_log.cpuN.raw with splice(),
+ * so no byte is copied through user space.
+ */
+struct raw_cpu {
+        int cpu;
+        int in_fd;                      /* per_cpu/cpuN/trace_pipe_raw */
+        int out_fd;                     /* ftrace_log.cpuN.raw */
+        int pipe[2];
+        char file[PATH_MAX];
+        size_t total_write;
+        unsigned long bytes;            /* Spliced since start */
+        unsigned long base_overrun;     /* Counters at start of capture */
+        unsigned long base_dropped;
+        pthread_t thread;
+        int joined;
+        pthread_t compressor;           /* Compressing rotated */
+        int compressing;
+        char rotated[PATH_MAX];
+        double last_rotate;
+        struct retain retain;
+};
+
+struct raw_cpu *raw_cpus;
+int nr_raw_cpus;
+
+/*
+ * Text capture: the main thread only drains trace_pipe into a pool of
+ * preallocated buffers. Filled buffers are handed to the writer thread,
+ * and written ones handed back, over two lock-free single producer single
+ * consumer rings. When the writer falls behind and no free buffer is
+ * left, the reader drops its current buffer rather than stop draining.
+ */
+struct tbuf {
+        size_t len;
+        char *data;
+};
+
+struct spsc {
+        unsigned int mask;              /* Number of slots - 1 */
+        unsigned int head;              /* Next slot to pop, by consumer */
+        unsigned int tail;              /* Next slot to push, by producer */
+        struct tbuf **slot;
+};
+
+struct spsc full_ring, free_ring;
+sem_t full_sem;                         /* Posted per pushed full buffer */
+unsigned long nr_tbufs = NR_TBUFS;
+unsigned long tbufs_written;
+unsigned long tbufs_dropped;            /* Overwritten while writer is busy */
+unsigned int tbufs_hwm;                 /* High water mark of full_ring */
+volatile int reader_done;
+
+/*
+ * Formatted seconds are cached, so a line only copies the cached string
+ * and, with -e, rewrites the microseconds.
+ */
+struct ts_cache {
+        time_t sec;                     /* Second formatted in str */
+        size_t len;
+        char str[TS_MAX];
+};
+
+/* -t and -e differ in layout, a -e line may fall back to -t */
+struct ts_cache wall_cache = { .sec = -1 };
+struct ts_cache event_cache = { .sec = -1 };
+long long ts_offset_ns;                 /* Wallclock - trace clock, for -e */
+char ts_last[TS_MAX];                   /* Prefix of last -e line */
+size_t ts_last_len;
+
+/*
+ * Log output: the stream is deflated into WBUF_SZ aligned buffers which
+ * are written at increasing offsets, either submitted to io_uring or, as
+ * fallback, with pwritev() as each one is filled. An idle log is pushed
+ * out by log_sync(), so a crash loses at most LOG_SYNC_SECS of it.
+ */
+struct wbuf {
+        char *data;
+        size_t len;
+        off_t off;
+        int busy;                       /* Submitted or waiting for pwritev */
+};
+
+struct uring {
+        int fd;
+        unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned int *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        unsigned int inflight;
+};
+
+struct log_out {
+        int fd;
+        int direct;                     /* fd is O_DIRECT */
+        off_t off;                      /* Offset of next buffer */
+        z_stream zs;
+        struct wbuf bufs[NR_WBUFS];
+        int cur;                        /* Buffer being filled */
+        double submitted;               /* Time of last write or log_sync() */
+        struct uring ring;
+} lo = { .fd = -1, .ring.fd = -1 };
+
+/*
+ * Segment format (-S): the log is a series of blocks, each one an
+ * independent gzip member (or plain text with -C) holding whole lines.
+ * When the file is finished an index of the blocks and a trailer are
+ * appended, so a query only decodes the blocks of its time range:
+ *
+ * | block 0 | block 1 | ... | seg_entry[nr] | seg_trailer |
+ *
+ * gzip -d still reads the blocks, and ignores the index as trailing
+ * garbage.
+ */
+struct seg_entry {
+        uint64_t first_ns;              /* Min trace timestamp in block */
+        uint64_t last_ns;               /* Max trace timestamp in block */
+        uint64_t off;                   /* File offset of block */
+        uint32_t clen;                  /* Bytes of block in file */
+        uint32_t rlen;                  /* Bytes of text in block */
+        uint32_t cpu;                   /* Cpu of first line */
+        uint32_t pad;
+};
+
+struct seg_trailer {
+        uint64_t index_off;
+        uint64_t nr_entries;
+        uint32_t block_sz;
+        uint32_t flags;
+        char magic[8];
+};
+
+int segment = 0;                        /* Write segment format */
+size_t seg_block = SEG_BLOCK_KB << 10;
+struct seg_entry *seg_index;
+size_t seg_nr, seg_alloc;
+struct seg_entry seg_cur;               /* Block being written */
+
+/*
+ * Filter and aggregation (-F rules): each line is looked up by event
+ * name in a hash, the first matching rule decides whether it is passed
+ * to the log, dropped, or only counted. A rule file has one rule per
+ * line, rules of a named event are tried before the "*" ones:
+ *
+ *   # action event         [field=value|field=prefix*] [hist_field]
+ *   drop     sched_stat_runtime
+ *   count    irq_handler_entry
+ *   hist     sched_switch  prev_comm=kworker*  prev_pid
+ *   pass     *
+ *
+ * Counts and log2 histograms are written to the log every -a seconds
+ * as "# summary" lines. Lines no rule matches are passed.
+ */
+#define AGG_PASS        0
+#define AGG_DROP        1
+#define AGG_COUNT       2               /* Drop, count it */
+#define AGG_HIST        3               /* Drop, count and histogram a field */
+
+struct agg_rule {
+        int action;
+        char *event;
+        char *field;                    /* Match "field=value", or NULL */
+        char *value;
+        size_t value_len;
+        int prefix;                     /* value ended with '*' */
+        char *hist_field;
+        unsigned long count;
+        unsigned long hist[AGG_BUCKETS];
+        struct agg_rule *next;          /* Next rule of the event */
+};
+
+struct agg_slot {
+        const char *event;
+        size_t len;
+        struct agg_rule *rules;
+};
+
+const char *agg_actions[] = { "pass", "drop", "count", "hist" };
+struct agg_slot agg_hash[AGG_HASH_SZ];
+struct agg_rule *agg_any;               /* Rules of "*" */
+struct agg_rule **agg_rules;            /* Every rule in file order */
+int agg_nr;
+int agg_interval = AGG_INTERVAL;
+double agg_last;                        /* Time of last summary */
+unsigned long agg_passed, agg_dropped;
+
+/*
+ * Tracing control (-P conf): settings under tracing_dir are applied at
+ * start, all or none, and the previous values are written back at exit.
+ * A conf file has one setting per line:
+ *
+ *   buffer_size_kb  8192
+ *   tracing_cpumask ff
+ *   event           sched/sched_switch
+ *   filter          sched/sched_switch prev_pid != 0
+ *   set             options/irq-info 0
+ *   auto_buffer     262144             # Grow buffer_size_kb up to this
+ *
+ * With auto_buffer, buffer_size_kb is grown to hold AUTO_SECS of the
+ * drain rate seen by the reader, and doubled when the kernel reports
+ * overruns, never beyond the cap.
+ */
+struct ctl_setting {
+        char file[PATH_MAX];            /* Relative to tracing_dir */
+        char old[CTL_VAL_MAX];          /* Value before we started */
+        char *val;
+        int applied;
+};
+
+struct ctl_setting *ctl_settings;
+int ctl_nr;
+unsigned long auto_max_kb;              /* 0: auto buffer disabled */
+unsigned long buffer_kb;                /* Current buffer_size_kb */
+unsigned long ctl_lost;                 /* Overruns seen at last check */
+double ctl_last;
+size_t ctl_bytes;                       /* Reader bytes at last check */
+
+/*
+ * Metrics (-M file): counters below have a single writer each and are
+ * read without locks by the metrics thread, which rewrites the file in
+ * Prometheus text format (fit for node_exporter's textfile collector)
+ * every METRICS_INTERVAL seconds.
+ */
+struct metrics {
+        unsigned long read_bytes;       /* Reader: from trace_pipe */
+        unsigned long lines;            /* Writer: lines handed over */
+        unsigned long log_in;           /* Writer: text into log stream */
+        unsigned long log_out;          /* Writer: bytes to log files */
+        unsigned long rotations;
+        double rotate_last_ms;
+        double rotate_max_ms;
+};
+
+struct metrics mt;
+char *metrics_file;
+double start_time;
+
+
+#define VERSION "2023.03.07"
+
+void usage(char *err_msg)
+{
+        if (err_msg)
+                fprintf(stderr, "[ERROR]: %s\n", err_msg);
+
+        fprintf(stderr, "Usage: %s [OPTION]...\n", prog);
+        fprintf(stderr, "Version: %s\n\n", VERSION);        
+        fprintf(stderr, "    -a secs       : Seconds between summaries of -F. Default: 60\n");
+        fprintf(stderr, "    -A secs       : Remove rotated logs older than secs\n");
+        fprintf(stderr, "    -b nr_bufs    : Number of 1M buffers between reader and writer. Default: 64\n");
+        fprintf(stderr, "    -B file       : Benchmark timestamp prefix on a trace_pipe capture\n");
+        fprintf(stderr, "    -c            : Compress the log. Default: enabled\n");
+        fprintf(stderr, "    -C            : Do not compress the log\n");
+        fprintf(stderr, "    -d dbg_lvl    : Set debug log level. Default: 2. {0: Debug, 1: Info, 2: Warn, 3: error}!\n");
+        fprintf(stderr, "    -e            : Add wallclock of the event, from trace timestamp. Implies -t\n");
+        fprintf(stderr, "    -f            : Start it on forground\n");
+        fprintf(stderr, "    -F rules      : Filter and aggregate events by rules in file\n");
+        fprintf(stderr, "    -h|H          : Print this message!\n");
+        fprintf(stderr, "    -i secs       : Rotate the log every secs, in addition to -s\n");
+        fprintf(stderr, "    -k block_kb   : Text KB per block of -S. Default: 256\n");
+        fprintf(stderr, "    -M file       : Write metrics to file every 5 seconds, Prometheus text format\n");
+        fprintf(stderr, "    -n nr_log     : Max number of rotated log files. Default: 10, max: 100000.\n");
+        fprintf(stderr, "    -O            : Write the log with O_DIRECT, bypass page cache\n");
+        fprintf(stderr, "    -p log_path   : Path to save log file. Default: /var/log/ftrace\n");
+        fprintf(stderr, "    -P conf       : Configure tracing by conf file on start, restore it on exit\n");
+        fprintf(stderr, "    -Q from,to    : Print lines with trace timestamp (sec) in [from, to] from logs in log_path\n");
+        fprintf(stderr, "    -r            : Raw mode, splice per-cpu trace_pipe_raw to ftrace_log.cpuN.raw\n");
+        fprintf(stderr, "    -R size       : Max total size of rotated logs, e.g. 10G\n");
+        fprintf(stderr, "    -s log_filesz : Log file size, Default: 100M, max 4096M.\n");
+        fprintf(stderr, "    -S            : Write log as indexed blocks, for -Q\n");
+        fprintf(stderr, "    -t            : Add wallclock to the log. default: disabled\n");
+        fprintf(stderr, "                  : [WARN]: The timestamp may not matched with log produce time\n");
+        fprintf(stderr, "    -T trace_dir  : Tracefs mount point. Default: /sys/kernel/debug/tracing\n");
+        fprintf(stderr, "    -u            : Submit log writes with io_uring, fallback to pwritev\n");
+        fprintf(stderr, "    -z level      : zlib compression level 1-9. Default: 6\n");
+        fprintf(stderr, "\n\n");
+
+        if (err_msg)
+                exit(-1);
+        exit(0);
+}
+
+int validate_and_set_path(char *path, char *dest, int mode)
+{
+        /* Path is too long */
+        if (strlen(path) > PATH_MAX - 1)
+                return -1;
+
+        /* Validate file permission */
+        if (access(path, mode) != 0)
+                return -1;
+
+        dprintf(DEBG, "File %s permission %d is ok!\n", path, mode);
+
+        /* Validate the path permission only */
+        if (dest == NULL)
+                return 0;
+
+        /* Copy the path to destention */
+        strncpy(dest, path, PATH_MAX);
+
+        return 0;
+}
+
+/*
+ * set_metrics_file -- keep -M as an absolute path, daemon() moves to "/".
+ */
+int set_metrics_file(const char *path)
+{
+        static char abs_path[PATH_MAX];
+        const char *base = strrchr(path, '/');
+        char dir[PATH_MAX];
+        size_t len;
+
+        base = base ? base + 1 : path;
+        if (*base == 0 || base - path >= PATH_MAX)
+                return -1;
+        snprintf(dir, PATH_MAX, "%.*s", (int)(base - path), path);
+        if (realpath(*dir ? dir : ".", abs_path) == NULL)
+                return -1;
+
+        len = strlen(abs_path);
+        if (snprintf(abs_path + len, PATH_MAX - len, "%s%s",
+                     abs_path[len - 1] == '/' ? "" : "/", base) >= PATH_MAX - len)
+                return -1;
+        metrics_file = abs_path;
+        return 0;
+}
+
+long parse_size(const char *s_sz)
+{
+        if (!s_sz || !strlen(s_sz))
+                return -1;
+
+        switch(s_sz[strlen(s_sz) - 1]) {
+                case 'k':
+                case 'K':
+                        return atol(s_sz) << 10;
+                case 'm':
+                case 'M':
+                        return atol(s_sz) << 20;
+                case 'g':
+                case 'G':
+                        return atol(s_sz) << 30;
+                /* Bytes */
+                case 'b':
+                case 'B':
+                case '0' ... '9':
+                        return atol(s_sz);
+                default:
+                        return -1;
+        }
+}
+
+int set_max_filesz(char *s_sz)
+{
+        long sz = parse_size(s_sz);
+
+        if (sz <= 0 || (sz >> 30) > 4)
+                return -1;
+        max_filesz = sz;
+        dprintf(DEBG, "max_filesz: %ld\n", max_filesz);
+        return 0;
+}
+
+double now_sec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * uring_setup -- a small io_uring for the log writes. liburing is not
+ *                required, the rings are mapped by hand.
+ */
+int uring_setup(struct uring *r, unsigned int entries)
+{
+        struct io_uring_params p;
+        size_t sq_sz, cq_sz, sqes_sz;
+        void *sq, *cq;
+
+        memset(&p, 0, sizeof(p));
+        r->fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (r->fd < 0)
+                return -1;
+
+        sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+        cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+        sq = mmap(NULL, sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  r->fd, IORING_OFF_SQ_RING);
+        cq = mmap(NULL, cq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  r->fd, IORING_OFF_CQ_RING);
+        r->sqes = mmap(NULL, sqes_sz, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+        if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+                if (sq != MAP_FAILED)
+                        munmap(sq, sq_sz);
+                if (cq != MAP_FAILED)
+                        munmap(cq, cq_sz);
+                if (r->sqes != MAP_FAILED)
+                        munmap(r->sqes, sqes_sz);
+                close(r->fd);
+                r->fd = -1;
+                return -1;
+        }
+
+        r->sq_head = sq + p.sq_off.head;
+        r->sq_tail = sq + p.sq_off.tail;
+        r->sq_mask = sq + p.sq_off.ring_mask;
+        r->sq_array = sq + p.sq_off.array;
+        r->cq_head = cq + p.cq_off.head;
+        r->cq_tail = cq + p.cq_off.tail;
+        r->cq_mask = cq + p.cq_off.ring_mask;
+        r->cqes = cq + p.cq_off.cqes;
+        r->inflight = 0;
+        return 0;
+}
+
+int uring_submit_write(struct uring *r, int fd, struct wbuf *b, int idx)
+{
+        unsigned int tail = *r->sq_tail;
+        unsigned int i = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[i];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long)b->data;
+        sqe->len = b->len;
+        sqe->off = b->off;
+        sqe->user_data = idx;
+        r->sq_array[i] = i;
+        __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        while (syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) < 0) {
+                if (errno != EINTR)
+                        return -1;
+        }
+        r->inflight++;
+        return 0;
+}
+
+/*
+ * write_full -- synchronous write of what io_uring did not write.
+ */
+void write_full(int fd, const char *buf, size_t len, off_t off)
+{
+        ssize_t n;
+
+        while (len) {
+                n = pwrite(fd, buf, len, off);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        dprintf(ERR, "Failed to write %s(%s)\n", log_file, strerror(errno));
+                        exit(-1);
+                }
+                buf += n;
+                len -= n;
+                off += n;
+        }
+}
+
+/*
+ * uring_reap -- wait for one completion, retry short or failed writes
+ *               with pwrite(), give up io_uring if the kernel can not
+ *               do the write opcode.
+ */
+void uring_reap(struct uring *r)
+{
+        struct io_uring_cqe *cqe;
+        struct wbuf *b;
+        unsigned int head;
+
+        head = *r->cq_head;
+        while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+                if (syscall(__NR_io_uring_enter, r->fd, 0, 1,
+                            IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                        dprintf(ERR, "io_uring_enter failed(%s)\n", strerror(errno));
+                        exit(-1);
+                }
+        }
+
+        cqe = &r->cqes[head & *r->cq_mask];
+        b = &lo.bufs[cqe->user_data];
+        if (cqe->res < 0) {
+                if (cqe->res != -EINVAL && cqe->res != -EOPNOTSUPP) {
+                        dprintf(ERR, "Failed to write %s(%s)\n", log_file,
+                                strerror(-cqe->res));
+                        exit(-1);
+                }
+                dprintf(WARN, "io_uring can not write, fallback to pwritev\n");
+                use_uring = 0;
+                write_full(lo.fd, b->data, b->len, b->off);
+        } else if ((size_t)cqe->res < b->len) {
+                write_full(lo.fd, b->data + cqe->res, b->len - cqe->res,
+                           b->off + cqe->res);
+        }
+        b->busy = 0;
+        r->inflight--;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * flush_busy -- pwritev() the buffers waiting right before the current
+ *               one, in file order. Nothing may be in flight on io_uring.
+ */
+void flush_busy(void)
+{
+        struct iovec iov[NR_WBUFS];
+        struct wbuf *b;
+        ssize_t n;
+        int i, nr, first;
+
+        for (nr = 0; nr < NR_WBUFS; nr++)
+                if (!lo.bufs[(lo.cur + NR_WBUFS - 1 - nr) % NR_WBUFS].busy)
+                        break;
+        if (nr == 0)
+                return;
+
+        first = (lo.cur + NR_WBUFS - nr) % NR_WBUFS;
+        for (i = 0; i < nr; i++) {
+                b = &lo.bufs[(first + i) % NR_WBUFS];
+                iov[i].iov_base = b->data;
+                iov[i].iov_len = b->len;
+        }
+
+        n = pwritev(lo.fd, iov, nr, lo.bufs[first].off);
+        if (n < 0 && errno != EINTR) {
+                dprintf(ERR, "Failed to write %s(%s)\n", log_file, strerror(errno));
+                exit(-1);
+        }
+        /* Short or interrupted, finish buffer by buffer */
+        n = n < 0 ? 0 : n;
+        for (i = 0; i < nr; i++) {
+                b = &lo.bufs[(first + i) % NR_WBUFS];
+                if (n < (ssize_t)b->len) {
+                        write_full(lo.fd, b->data + n, b->len - n, b->off + n);
+                        n = 0;
+                } else {
+                        n -= b->len;
+                }
+                b->busy = 0;
+        }
+}
+
+/*
+ * wbuf_submit -- queue the current buffer and move to the next one,
+ *                waiting for it if it is still busy.
+ */
+void wbuf_submit(void)
+{
+        struct wbuf *b = &lo.bufs[lo.cur];
+
+        if (b->len == 0)
+                return;
+
+        b->off = lo.off;
+        lo.off += b->len;
+        mt.log_out += b->len;
+        b->busy = 1;
+        lo.submitted = now_sec();
+        if (use_uring && uring_submit_write(&lo.ring, lo.fd, b, lo.cur) != 0) {
+                dprintf(WARN, "io_uring submit failed, fallback to pwritev\n");
+                use_uring = 0;
+        }
+
+        lo.cur = (lo.cur + 1) % NR_WBUFS;
+        if (!use_uring)
+                flush_busy();
+        b = &lo.bufs[lo.cur];
+        while (b->busy && lo.ring.inflight)
+                uring_reap(&lo.ring);
+        if (b->busy)
+                flush_busy();
+        b->len = 0;
+}
+
+/*
+ * wbuf_drain -- wait for every buffer, the current one included.
+ */
+void wbuf_drain(void)
+{
+        struct wbuf *b = &lo.bufs[lo.cur];
+
+        /* O_DIRECT takes whole aligned blocks, write the tail buffered */
+        if (lo.direct && b->len % WBUF_ALIGN) {
+                while (lo.ring.inflight)
+                        uring_reap(&lo.ring);
+                flush_busy();
+                fcntl(lo.fd, F_SETFL, fcntl(lo.fd, F_GETFL) & ~O_DIRECT);
+                lo.direct = 0;
+        }
+        wbuf_submit();
+        while (lo.ring.inflight)
+                uring_reap(&lo.ring);
+        flush_busy();
+}
+
+void wbuf_put(const char *data, size_t len)
+{
+        struct wbuf *b;
+        size_t n;
+
+        while (len) {
+                b = &lo.bufs[lo.cur];
+                n = WBUF_SZ - b->len < len ? WBUF_SZ - b->len : len;
+                memcpy(b->data + b->len, data, n);
+                b->len += n;
+                data += n;
+                len -= n;
+                if (b->len == WBUF_SZ)
+                        wbuf_submit();
+        }
+}
+
+/*
+ * deflate_to_wbuf -- run deflate with output straight into write buffers.
+ */
+void deflate_to_wbuf(int flush)
+{
+        struct wbuf *b;
+        int ret;
+
+        do {
+                b = &lo.bufs[lo.cur];
+                lo.zs.next_out = (Bytef *)b->data + b->len;
+                lo.zs.avail_out = WBUF_SZ - b->len;
+                ret = deflate(&lo.zs, flush);
+                if (ret == Z_STREAM_ERROR) {
+                        dprintf(ERR, "deflate failed\n");
+                        exit(-1);
+                }
+                b->len = WBUF_SZ - lo.zs.avail_out;
+                if (b->len == WBUF_SZ)
+                        wbuf_submit();
+        } while (lo.zs.avail_in ||
+                 (flush == Z_FINISH ? ret != Z_STREAM_END :
+                  flush != Z_NO_FLUSH && lo.zs.avail_out == 0));
+}
+
+/*
+ * log_sync -- when nothing was written for LOG_SYNC_SECS, flush deflate
+ *             and write the partial buffer, so a slow trace is not kept
+ *             in memory until a buffer fills.
+ */
+void log_sync(void)
+{
+        if (lo.fd < 0 || now_sec() - lo.submitted < LOG_SYNC_SECS)
+                return;
+        if (do_compress)
+                deflate_to_wbuf(Z_SYNC_FLUSH);
+        wbuf_drain();
+        lo.submitted = now_sec();
+}
+
+/*
+ * log_write -- append data to the log, deflated unless -C.
+ */
+void log_write(const char *data, size_t len)
+{
+        mt.log_in += len;
+        if (!do_compress) {
+                wbuf_put(data, len);
+                return;
+        }
+        lo.zs.next_in = (Bytef *)data;
+        lo.zs.avail_in = len;
+        deflate_to_wbuf(Z_NO_FLUSH);
+}
+
+/*
+ * close_logfile -- finish the gzip member, wait for all writes and drop
+ *                  the finished log from page cache.
+ */
+void close_logfile(void)
+{
+        if (lo.fd < 0)
+                return;
+
+        /* Segment blocks are finished by seg_finish() */
+        if (do_compress) {
+                if (!segment)
+                        deflate_to_wbuf(Z_FINISH);
+                deflateEnd(&lo.zs);
+        }
+        wbuf_drain();
+        fdatasync(lo.fd);
+        posix_fadvise(lo.fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(lo.fd);
+        lo.fd = -1;
+}
+
+/*
+ * open_logfile -- open log_file.gz and start a gzip member, so data is
+ *                 compressed as it is written. An existing file gets
+ *                 a new member appended. Without compression the log
+ *                 is a plain file.
+ */
+int open_logfile(void)
+{
+        char file[PATH_MAX];
+        int i, flags = O_WRONLY|O_CREAT;
+
+        if (lo.bufs[0].data == NULL) {
+                for (i = 0; i < NR_WBUFS; i++)
+                        if (posix_memalign((void **)&lo.bufs[i].data,
+                                           WBUF_ALIGN, WBUF_SZ))
+                                return -1;
+                if (use_uring && uring_setup(&lo.ring, NR_WBUFS) != 0) {
+                        dprintf(WARN, "No io_uring(%s), fallback to pwritev\n",
+                                strerror(errno));
+                        use_uring = 0;
+                }
+        }
+
+        snprintf(file, PATH_MAX, "%s%s", log_file, suffix);
+        lo.fd = open(file, flags | (use_direct ? O_DIRECT : 0), 0644);
+        if (lo.fd < 0 && use_direct) {
+                dprintf(WARN, "No O_DIRECT on %s(%s)\n", file, strerror(errno));
+                use_direct = 0;
+                lo.fd = open(file, flags, 0644);
+        }
+        if (lo.fd < 0) {
+                dprintf(ERR, "Can not open logfile %s\n", file);
+                exit(-1);
+        }
+
+        lo.off = lseek(lo.fd, 0, SEEK_END);
+        lo.direct = use_direct;
+        /* Appending at an unaligned offset can not use O_DIRECT */
+        if (lo.direct && lo.off % WBUF_ALIGN) {
+                fcntl(lo.fd, F_SETFL, fcntl(lo.fd, F_GETFL) & ~O_DIRECT);
+                lo.direct = 0;
+        }
+
+        lo.cur = 0;
+        lo.submitted = now_sec();
+        for (i = 0; i < NR_WBUFS; i++)
+                lo.bufs[i].len = lo.bufs[i].busy = 0;
+
+        if (do_compress) {
+                memset(&lo.zs, 0, sizeof(lo.zs));
+                /* 16 + MAX_WBITS: gzip header and trailer */
+                if (deflateInit2(&lo.zs, compress_level, Z_DEFLATED,
+                                 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                        dprintf(ERR, "Failed to init zlib\n");
+                        exit(-1);
+                }
+        }
+        return 0;
+}
+
+static int retain_name(char *buf, const char *file, const struct rlog *l,
+                       const char *sfx)
+{
+        char ts[32];
+        struct tm tm;
+
+        localtime_r(&l->time, &tm);
+        strftime(ts, sizeof(ts), "%Y%m%d-%H%M%S", &tm);
+        return snprintf(buf, PATH_MAX, "%s.%lu.%s%s", file, l->seq, ts, sfx) <
+               PATH_MAX ? 0 : -1;
+}
+
+static int retain_push(struct retain *r, const struct rlog *l)
+{
+        struct rlog *e;
+        unsigned long i, cap;
+
+        if (r->nr == r->cap) {
+                cap = r->cap ? r->cap * 2 : 64;
+                e = malloc(cap * sizeof(*e));
+                if (e == NULL)
+                        return -1;
+                for (i = 0; i < r->nr; i++)
+                        e[i] = r->e[(r->head + i) % r->cap];
+                free(r->e);
+                r->e = e;
+                r->cap = cap;
+                r->head = 0;
+        }
+        r->e[(r->head + r->nr) % r->cap] = *l;
+        r->nr++;
+        r->bytes += l->size;
+        if (l->seq >= r->next_seq)
+                r->next_seq = l->seq + 1;
+        return 0;
+}
+
+static inline struct rlog *retain_at(struct retain *r, unsigned long i)
+{
+        return &r->e[(r->head + i) % r->cap];
+}
+
+/*
+ * retain_trim -- unlink the oldest rotated files beyond -n, -R or -A,
+ *                the newest one is kept whatever its size and age.
+ */
+void retain_trim(struct retain *r, const char *file, const char *sfx)
+{
+        char name[PATH_MAX];
+        time_t now = time(NULL);
+        struct rlog *l;
+
+        while (r->nr > nr_logs ||
+               (r->nr > 1 && retain_bytes && r->bytes > retain_bytes) ||
+               (r->nr > 1 && retain_secs && now - r->e[r->head].time > retain_secs)) {
+                l = &r->e[r->head];
+                if (retain_name(name, file, l, sfx) == 0) {
+                        dprintf(DEBG, "Remove %s\n", name);
+                        remove(name);
+                }
+                r->bytes -= l->size;
+                r->head = (r->head + 1) % r->cap;
+                r->nr--;
+        }
+}
+
+static int rlog_cmp(const void *a, const void *b)
+{
+        const struct rlog *x = a, *y = b;
+
+        return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * retain_scan -- load the rotated files of file from its directory,
+ *                oldest first.
+ */
+int retain_scan(struct retain *r, const char *file, const char *sfx)
+{
+        char dir[PATH_MAX], path[PATH_MAX];
+        const char *base = strrchr(file, '/');
+        size_t blen, i, n = 0, cap = 0;
+        struct rlog l, *v = NULL, *t;
+        struct dirent *de;
+        struct stat st;
+        struct tm tm;
+        char *p, *q;
+        DIR *d;
+
+        base = base ? base + 1 : file;
+        snprintf(dir, PATH_MAX, "%.*s", (int)(base - file), file);
+        d = opendir(*dir ? dir : ".");
+        if (d == NULL)
+                return -1;
+
+        blen = strlen(base);
+        while ((de = readdir(d))) {
+                p = de->d_name;
+                if (strncmp(p, base, blen) || p[blen] != '.' ||
+                    !isdigit(p[blen + 1]))
+                        continue;
+                l.seq = strtoul(p + blen + 1, &q, 10);
+                if (*q != '.')
+                        continue;
+                memset(&tm, 0, sizeof(tm));
+                q = strptime(q + 1, "%Y%m%d-%H%M%S", &tm);
+                if (q == NULL || strcmp(q, sfx))
+                        continue;
+                tm.tm_isdst = -1;
+                l.time = mktime(&tm);
+                if (snprintf(path, PATH_MAX, "%s%s", dir, p) >= PATH_MAX)
+                        continue;
+                l.size = stat(path, &st) == 0 ? st.st_size : 0;
+
+                if (n == cap) {
+                        cap = cap ? cap * 2 : 64;
+                        t = realloc(v, cap * sizeof(*v));
+                        if (t == NULL)
+                                break;
+                        v = t;
+                }
+                v[n++] = l;
+        }
+        closedir(d);
+
+        qsort(v, n, sizeof(*v), rlog_cmp);
+        r->head = r->nr = r->bytes = 0;
+        for (i = 0; i < n; i++)
+                retain_push(r, &v[i]);
+        free(v);
+        return 0;
+}
+
+/*
+ * retain_upgrade -- rename the file.<N><sfx> logs of older versions, .0 the
+ *                   newest, into the retain ring so -n, -R and -A see them.
+ */
+void retain_upgrade(struct retain *r, const char *file, const char *sfx)
+{
+        char dir[PATH_MAX], path[PATH_MAX], new_file[PATH_MAX];
+        const char *base = strrchr(file, '/');
+        size_t blen, n = 0, cap = 0;
+        struct rlog l, *v = NULL, *t;
+        struct dirent *de;
+        struct stat st;
+        char *p, *q;
+        DIR *d;
+
+        base = base ? base + 1 : file;
+        snprintf(dir, PATH_MAX, "%.*s", (int)(base - file), file);
+        d = opendir(*dir ? dir : ".");
+        if (d == NULL)
+                return;
+
+        blen = strlen(base);
+        while ((de = readdir(d))) {
+                p = de->d_name;
+                if (strncmp(p, base, blen) || p[blen] != '.' ||
+                    !isdigit(p[blen + 1]))
+                        continue;
+                l.seq = strtoul(p + blen + 1, &q, 10);
+                if (strcmp(q, sfx) ||
+                    snprintf(path, PATH_MAX, "%s%s", dir, p) >= PATH_MAX ||
+                    stat(path, &st) != 0)
+                        continue;
+                l.time = st.st_mtime;
+                l.size = st.st_size;
+
+                if (n == cap) {
+                        cap = cap ? cap * 2 : 16;
+                        t = realloc(v, cap * sizeof(*v));
+                        if (t == NULL)
+                                break;
+                        v = t;
+                }
+                v[n++] = l;
+        }
+        closedir(d);
+
+        qsort(v, n, sizeof(*v), rlog_cmp);
+        while (n--) {
+                snprintf(path, PATH_MAX, "%s.%lu%s", file, v[n].seq, sfx);
+                v[n].seq = r->next_seq;
+                if (retain_name(new_file, file, &v[n], sfx))
+                        continue;
+                dprintf(INFO, "Rename %s => %s\n", path, new_file);
+                if (rename(path, new_file)) {
+                        dprintf(WARN, "Failed to rename file %s\n", path);
+                        continue;
+                }
+                if (retain_push(r, &v[n]) != 0)
+                        dprintf(WARN, "No memory to retain %s\n", new_file);
+        }
+        free(v);
+}
+
+/*
+ * rotate_file -- move cur to the next file.<seq>.<time><cur_sfx>, it is
+ *                retained as <sfx>, then trim the oldest ones. The new
+ *                name is returned in rotated if not NULL.
+ */
+void rotate_file(struct retain *r, const char *file, const char *cur,
+                 const char *sfx, const char *cur_sfx, char *rotated)
+{
+        char new_file[PATH_MAX];
+        struct stat st;
+        struct rlog l;
+
+        l.seq = r->next_seq;
+        l.time = time(NULL);
+        if (retain_name(new_file, file, &l, cur_sfx)) {
+                dprintf(ERR, "Rotated name of %s is too long\n", cur);
+                exit(-1);
+        }
+        dprintf(DEBG, "Rename %s => %s\n", cur, new_file);
+        if (rename(cur, new_file)) {
+                dprintf(ERR, "Failed to rename file %s\n", cur);
+                exit(-1);
+        }
+        l.size = stat(new_file, &st) == 0 ? st.st_size : 0;
+        if (retain_push(r, &l) != 0)
+                dprintf(WARN, "No memory to retain %s\n", new_file);
+        if (rotated)
+                strcpy(rotated, new_file);
+
+        retain_trim(r, file, sfx);
+}
+
+static void rotate_done(double start)
+{
+        mt.rotate_last_ms = (now_sec() - start) * 1000;
+        if (mt.rotate_last_ms > mt.rotate_max_ms)
+                mt.rotate_max_ms = mt.rotate_last_ms;
+        mt.rotations++;
+}
+
+/*
+ * do_rotate_and_compress -- the stream is already compressed, so rotation
+ *                           is only finish the stream and rename it.
+ */
+void do_rotate_and_compress(size_t total_write)
+{
+        char cur_file[PATH_MAX];
+        double start = now_sec();
+
+        /* Close log file */
+        close_logfile();
+
+        snprintf(cur_file, PATH_MAX, "%s%s", log_file, suffix);
+        rotate_file(&text_retain, log_file, cur_file, suffix, suffix, NULL);
+
+        /* Create new log file */
+        if (open_logfile() != 0) {
+                dprintf(ERR, "Failed to open %s(%s)\n", log_file, strerror(errno));
+                exit(-1);
+        }
+
+        rotate_done(start);
+        dprintf(INFO, "Rotate: %zu bytes in %.1fs (%.2f MB/s), latency %.3fms\n",
+                total_write, start - last_rotate,
+                total_write / 1048576.0 / (start - last_rotate + 1e-9),
+                mt.rotate_last_ms);
+        last_rotate = start;
+}
+
+/*
+ * compress_file -- compress file to file<suffix> with zlib and remove it.
+ */
+int compress_file(const char *file)
+{
+        char gz_file[PATH_MAX], mode[16];
+        char *buf;
+        gzFile gz;
+        ssize_t n = 0;
+        int fd;
+
+        fd = open(file, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        snprintf(gz_file, PATH_MAX, "%s%s", file, suffix);
+        snprintf(mode, sizeof(mode), "wb%d", compress_level < 0 ? 6 : compress_level);
+        gz = gzopen(gz_file, mode);
+        buf = malloc(GZ_BUF_SZ);
+        if (gz == NULL || buf == NULL)
+                goto out;
+
+        while ((n = read(fd, buf, GZ_BUF_SZ)) > 0) {
+                if (gzwrite(gz, buf, n) != n) {
+                        n = -1;
+                        break;
+                }
+        }
+out:
+        free(buf);
+        close(fd);
+        if (gz == NULL || gzclose(gz) != Z_OK || n < 0) {
+                dprintf(ERR, "Failed to compress %s\n", file);
+                return -1;
+        }
+        unlink(file);
+        return 0;
+}
+
+void *compress_worker(void *arg)
+{
+        struct raw_cpu *rc = arg;
+
+        compress_file(rc->rotated);
+        return NULL;
+}
+
+/*
+ * rotate_raw -- rotate a per-cpu raw file, the rotated file is compressed
+ *               by another thread so the reader keeps draining.
+ */
+void rotate_raw(struct raw_cpu *rc)
+{
+        double start = now_sec();
+        struct retain *r = &rc->retain;
+        char gz_file[PATH_MAX];
+        struct stat st;
+        struct rlog *l;
+
+        /* Account the previous one by its compressed size */
+        if (rc->compressing) {
+                pthread_join(rc->compressor, NULL);
+                rc->compressing = 0;
+                snprintf(gz_file, PATH_MAX, "%s%s", rc->rotated, suffix);
+                if (r->nr && stat(gz_file, &st) == 0) {
+                        l = retain_at(r, r->nr - 1);
+                        r->bytes += st.st_size - l->size;
+                        l->size = st.st_size;
+                }
+        }
+
+        rotate_file(r, rc->file, rc->file, suffix, "", rc->rotated);
+        rotate_done(start);
+        rc->last_rotate = start;
+        if (!do_compress)
+                return;
+
+        if (pthread_create(&rc->compressor, NULL, compress_worker, rc) == 0)
+                rc->compressing = 1;
+        else
+                compress_worker(rc);
+}
+
+int spsc_init(struct spsc *r, unsigned long nr)
+{
+        unsigned int size = 1;
+
+        while (size < nr)
+                size <<= 1;
+        r->slot = calloc(size, sizeof(*r->slot));
+        r->mask = size - 1;
+        r->head = r->tail = 0;
+        return r->slot ? 0 : -1;
+}
+
+static inline unsigned int spsc_count(struct spsc *r)
+{
+        return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+               __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+/* Never full, the ring has a slot for every buffer */
+static inline void spsc_push(struct spsc *r, struct tbuf *b)
+{
+        unsigned int tail = r->tail;
+
+        r->slot[tail & r->mask] = b;
+        __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline struct tbuf *spsc_pop(struct spsc *r)
+{
+        unsigned int head = r->head;
+        struct tbuf *b;
+
+        if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+                return NULL;
+        b = r->slot[head & r->mask];
+        __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+        return b;
+}
+
+/*
+ * tbuf_init -- allocate the buffer pool, all buffers start on free_ring.
+ */
+int tbuf_init(void)
+{
+        struct tbuf *b;
+        unsigned long i;
+
+        if (spsc_init(&full_ring, nr_tbufs) || spsc_init(&free_ring, nr_tbufs))
+                return -1;
+        sem_init(&full_sem, 0, 0);
+
+        for (i = 0; i < nr_tbufs; i++) {
+                b = malloc(sizeof(*b));
+                if (b == NULL)
+                        return -1;
+                b->len = 0;
+                b->data = malloc(TBUF_SZ);
+                if (b->data == NULL)
+                        return -1;
+                spsc_push(&free_ring, b);
+        }
+        return 0;
+}
+
+/*
+ * hand_over -- queue a filled buffer to the writer and return an empty
+ *              one. If there is none, the data of cur is dropped.
+ */
+struct tbuf *hand_over(struct tbuf *cur)
+{
+        struct tbuf *next;
+        unsigned int queued;
+
+        if (cur->len == 0)
+                return cur;
+
+        next = spsc_pop(&free_ring);
+        if (next == NULL) {
+                tbufs_dropped++;
+                dprintf(DEBG, "Writer is behind, dropped %lu buffers\n",
+                        tbufs_dropped);
+                cur->len = 0;
+                return cur;
+        }
+
+        spsc_push(&full_ring, cur);
+        sem_post(&full_sem);
+        queued = spsc_count(&full_ring);
+        if (queued > tbufs_hwm)
+                tbufs_hwm = queued;
+
+        next->len = 0;
+        return next;
+}
+
+/*
+ * ts_setup -- for -e, get the offset from the trace clock to wallclock
+ *             once. The default "local" clock is sched_clock(), which
+ *             runs with CLOCK_MONOTONIC closely enough.
+ */
+int ts_setup(void)
+{
+        char path[PATH_MAX], buf[256], *p, *q;
+        struct timespec wall, mono;
+        clockid_t clk = CLOCK_MONOTONIC;
+        FILE *fp;
+
+        fp = snprintf(path, PATH_MAX, "%s/trace_clock", tracing_dir) < PATH_MAX ?
+             fopen(path, "r") : NULL;
+        if (fp && fgets(buf, sizeof(buf), fp) &&
+            (p = strchr(buf, '[')) && (q = strchr(p, ']'))) {
+                *q = '\0';
+                p++;
+                if (!strcmp(p, "boot"))
+                        clk = CLOCK_BOOTTIME;
+                else if (!strcmp(p, "mono_raw"))
+                        clk = CLOCK_MONOTONIC_RAW;
+                else if (strcmp(p, "mono") && strcmp(p, "local") &&
+                         strcmp(p, "global") && strcmp(p, "perf")) {
+                        dprintf(WARN, "trace_clock %s is not a time, use -t\n", p);
+                        fclose(fp);
+                        return -1;
+                }
+                dprintf(DEBG, "trace_clock: %s\n", p);
+        }
+        if (fp)
+                fclose(fp);
+
+        clock_gettime(clk, &mono);
+        clock_gettime(CLOCK_REALTIME, &wall);
+        ts_offset_ns = (wall.tv_sec - mono.tv_sec) * 1000000000LL +
+                       wall.tv_nsec - mono.tv_nsec;
+        return 0;
+}
+
+/*
+ * find_trace_ts -- find "<sec>.<frac>: " of a trace_pipe line, e.g.
+ *                  "  <idle>-0  [001] d.h1 1234.567890: sched_switch:",
+ *                  return where the event name starts or NULL.
+ */
+const char *find_trace_ts(const char *line, size_t len, long long *ns)
+{
+        const char *end = line + len, *c, *d, *s;
+        long long sec, frac;
+        int digits;
+
+        for (c = line; c + 1 < end && (c = memchr(c, ':', end - c - 1)); c++) {
+                if (c[1] != ' ')
+                        continue;
+                for (d = c; d > line && isdigit(d[-1]); d--)
+                        ;
+                digits = c - d;
+                if (digits == 0 || digits > 9 || d - 1 <= line || d[-1] != '.')
+                        continue;
+                for (s = d - 1; s > line && isdigit(s[-1]); s--)
+                        ;
+                if (s == d - 1 || (s > line && s[-1] != ' '))
+                        continue;
+
+                for (sec = 0; s < d - 1; s++)
+                        sec = sec * 10 + *s - '0';
+                for (frac = 0; d < c; d++)
+                        frac = frac * 10 + *d - '0';
+                for (; digits < 9; digits++)
+                        frac *= 10;
+                *ns = sec * 1000000000LL + frac;
+                return c + 2;
+        }
+        return NULL;
+}
+
+int parse_trace_ts(const char *line, size_t len, long long *ns)
+{
+        return find_trace_ts(line, len, ns) ? 0 : -1;
+}
+
+static size_t ts_wall(char *dst)
+{
+        time_t now = time(NULL);
+        struct tm tm;
+
+        /* Same layout as ctime() */
+        if (now != wall_cache.sec) {
+                localtime_r(&now, &tm);
+                wall_cache.len = strftime(wall_cache.str, TS_MAX,
+                                        "%a %b %e %H:%M:%S %Y:", &tm);
+                wall_cache.sec = now;
+        }
+        memcpy(dst, wall_cache.str, wall_cache.len);
+        return wall_cache.len;
+}
+
+static size_t ts_event(char *dst, const char *line, size_t len)
+{
+        long long ns;
+        time_t sec;
+        struct tm tm;
+        unsigned int usec;
+        char *p;
+        int i;
+
+        /* No timestamp in line, e.g. a "LOST EVENTS" line */
+        if (parse_trace_ts(line, len, &ns)) {
+                if (ts_last_len == 0)
+                        ts_last_len = ts_wall(ts_last);
+                memcpy(dst, ts_last, ts_last_len);
+                return ts_last_len;
+        }
+
+        ns += ts_offset_ns;
+        sec = ns / 1000000000LL;
+        if (sec != event_cache.sec) {
+                localtime_r(&sec, &tm);
+                event_cache.len = strftime(event_cache.str, TS_MAX,
+                                        "%Y-%m-%d %H:%M:%S.", &tm);
+                event_cache.sec = sec;
+        }
+        memcpy(dst, event_cache.str, event_cache.len);
+        p = dst + event_cache.len;
+        usec = ns % 1000000000LL / 1000;
+        for (i = 5; i >= 0; i--, usec /= 10)
+                p[i] = '0' + usec % 10;
+        p[6] = ':';
+
+        ts_last_len = event_cache.len + 7;
+        memcpy(ts_last, dst, ts_last_len);
+        return ts_last_len;
+}
+
+/*
+ * ts_format -- write the prefix of a line to dst, return its length.
+ */
+size_t ts_format(char *dst, const char *line, size_t len)
+{
+        time_t curtime;
+        size_t n;
+
+        switch (timestamp) {
+        case TS_WALL:
+                return ts_wall(dst);
+        case TS_EVENT:
+                return ts_event(dst, line, len);
+        case TS_CTIME:
+                curtime = time(NULL);
+                strncpy(dst, ctime(&curtime), TS_MAX);
+                n = strlen(dst);
+                dst[n - 1] = ':';
+                return n;
+        }
+        return 0;
+}
+
+/*
+ * stamp_lines -- copy src to buffers, adding a timestamp at each line start.
+ */
+struct tbuf *stamp_lines(struct tbuf *cur, const char *src, size_t n,
+                         int *line_start)
+{
+        char ts[TS_MAX];
+        size_t ts_len, seg;
+        const char *nl;
+
+        while (n) {
+                nl = memchr(src, '\n', n);
+                seg = nl ? nl - src + 1 : n;
+                ts_len = *line_start ? ts_format(ts, src, seg) : 0;
+                if (TBUF_SZ - cur->len < seg + ts_len) {
+                        cur = hand_over(cur);
+                        /* A line longer than a buffer is split */
+                        if (TBUF_SZ - cur->len < seg + ts_len)
+                                seg = TBUF_SZ - cur->len - ts_len;
+                }
+
+                memcpy(cur->data + cur->len, ts, ts_len);
+                cur->len += ts_len;
+                memcpy(cur->data + cur->len, src, seg);
+                cur->len += seg;
+                *line_start = src[seg - 1] == '\n';
+                src += seg;
+                n -= seg;
+        }
+        return cur;
+}
+
+/*
+ * bench_run -- copy a capture into buffers the way read_trace_pipe()
+ *              does, return the seconds taken.
+ */
+double bench_run(const char *buf, size_t size)
+{
+        const char *p, *end = buf + size;
+        struct tbuf *cur, *b;
+        int line_start = 1;
+        double t;
+        size_t n;
+
+        cur = spsc_pop(&free_ring);
+        cur->len = 0;
+
+        t = now_sec();
+        for (p = buf; p < end; p += n) {
+                n = end - p < READ_MIN ? end - p : READ_MIN;
+                if (timestamp == TS_NONE) {
+                        if (TBUF_SZ - cur->len < n)
+                                cur = hand_over(cur);
+                        memcpy(cur->data + cur->len, p, n);
+                        cur->len += n;
+                } else {
+                        cur = stamp_lines(cur, p, n, &line_start);
+                }
+                /* Play the writer */
+                while ((b = spsc_pop(&full_ring)))
+                        spsc_push(&free_ring, b);
+        }
+        t = now_sec() - t;
+
+        spsc_push(&free_ring, cur);
+        return t;
+}
+
+/*
+ * bench_stamp -- lines/sec of copying a capture without timestamp, with
+ *                the old time()+ctime() per line, and with the cached -t
+ *                and -e prefixes. Best of 3 runs.
+ */
+int bench_stamp(const char *fn)
+{
+        static const char *names[] = { "none", "ctime", "-t", "-e" };
+        static const int modes[] = { TS_NONE, TS_CTIME, TS_WALL, TS_EVENT };
+        char *buf, *p, *end;
+        double t, elapsed[4];
+        long lines = 0;
+        FILE *fp;
+        long size;
+        int i, r;
+
+        fp = fopen(fn, "r");
+        if (fp == NULL) {
+                fprintf(stderr, "Failed to open %s\n", fn);
+                return -1;
+        }
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        rewind(fp);
+        buf = malloc(size);
+        if (buf == NULL || fread(buf, 1, size, fp) != (size_t)size) {
+                fprintf(stderr, "Failed to read %s\n", fn);
+                free(buf);
+                fclose(fp);
+                return -1;
+        }
+        fclose(fp);
+
+        for (p = buf, end = buf + size; (p = memchr(p, '\n', end - p)); p++)
+                lines++;
+
+        if (tbuf_init() != 0 || ts_setup() != 0)
+                return -1;
+
+        for (i = 0; i < 4; i++) {
+                timestamp = modes[i];
+                elapsed[i] = 1e30;
+                for (r = 0; r < 3; r++) {
+                        t = bench_run(buf, size);
+                        if (t < elapsed[i])
+                                elapsed[i] = t;
+                }
+        }
+
+        fprintf(stdout, "%s: %ld lines, %ld bytes\n", fn, lines, size);
+        for (i = 0; i < 4; i++)
+                fprintf(stdout, "  %-6s: %10.0f lines/s (%.1fx of ctime)\n",
+                        names[i], lines / elapsed[i], elapsed[1] / elapsed[i]);
+
+        free(buf);
+        return 0;
+}
+
+/*
+ * parse_trace_cpu -- cpu of "[001]" in a trace_pipe line.
+ */
+int parse_trace_cpu(const char *line, size_t len)
+{
+        const char *p = memchr(line, '[', len), *end = line + len;
+        int cpu = 0;
+
+        if (p == NULL)
+                return -1;
+        for (p++; p < end && isdigit(*p); p++)
+                cpu = cpu * 10 + *p - '0';
+        return p < end && *p == ']' ? cpu : -1;
+}
+
+static inline off_t log_offset(void)
+{
+        return lo.off + lo.bufs[lo.cur].len;
+}
+
+/*
+ * seg_lines -- update the time range of the block with the lines of data.
+ */
+void seg_lines(const char *data, size_t len)
+{
+        const char *p = data, *end = data + len, *nl;
+        long long ns;
+
+        for (; p < end && (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+                if (parse_trace_ts(p, nl - p, &ns))
+                        continue;
+                if (seg_cur.rlen == 0 && p == data)
+                        seg_cur.cpu = parse_trace_cpu(p, nl - p);
+                if ((uint64_t)ns < seg_cur.first_ns)
+                        seg_cur.first_ns = ns;
+                if ((uint64_t)ns > seg_cur.last_ns)
+                        seg_cur.last_ns = ns;
+        }
+}
+
+void seg_end_block(void)
+{
+        struct seg_entry *e;
+
+        if (seg_cur.rlen == 0)
+                return;
+
+        if (do_compress) {
+                deflate_to_wbuf(Z_FINISH);
+                deflateReset(&lo.zs);
+        }
+        seg_cur.clen = log_offset() - seg_cur.off;
+
+        if (seg_nr == seg_alloc) {
+                seg_alloc = seg_alloc ? seg_alloc * 2 : 1024;
+                e = realloc(seg_index, seg_alloc * sizeof(*e));
+                if (e == NULL) {
+                        dprintf(ERR, "Failed to alloc segment index\n");
+                        exit(-1);
+                }
+                seg_index = e;
+        }
+        seg_index[seg_nr++] = seg_cur;
+        seg_cur.rlen = 0;
+}
+
+/*
+ * seg_write -- append text to blocks, a block ends at the first line end
+ *              after seg_block bytes.
+ */
+void seg_write(const char *data, size_t len)
+{
+        const char *nl;
+        size_t n, skip;
+
+        while (len) {
+                if (seg_cur.rlen == 0) {
+                        seg_cur.off = log_offset();
+                        seg_cur.first_ns = UINT64_MAX;
+                        seg_cur.last_ns = 0;
+                        seg_cur.cpu = -1;
+                }
+
+                n = len;
+                skip = seg_block > seg_cur.rlen + 1 ? seg_block - seg_cur.rlen - 1 : 0;
+                if (skip < len && (nl = memchr(data + skip, '\n', len - skip)))
+                        n = nl - data + 1;
+
+                seg_lines(data, n);
+                log_write(data, n);
+                seg_cur.rlen += n;
+                if (n < len || seg_cur.rlen >= seg_block)
+                        seg_end_block();
+                data += n;
+                len -= n;
+        }
+}
+
+/*
+ * seg_finish -- end the last block, append index and trailer.
+ */
+void seg_finish(void)
+{
+        struct seg_trailer t;
+
+        seg_end_block();
+
+        memset(&t, 0, sizeof(t));
+        t.index_off = log_offset();
+        t.nr_entries = seg_nr;
+        t.block_sz = seg_block;
+        t.flags = do_compress ? SEG_COMPRESSED : 0;
+        memcpy(t.magic, SEG_MAGIC, sizeof(t.magic));
+        wbuf_put((char *)seg_index, seg_nr * sizeof(*seg_index));
+        wbuf_put((char *)&t, sizeof(t));
+        seg_nr = 0;
+}
+
+/*
+ * query_lines -- print lines of text with trace timestamp in [from, to].
+ */
+void query_lines(const char *text, size_t len, long long from, long long to)
+{
+        const char *p = text, *end = text + len, *nl;
+        long long ns;
+        int in = 0;
+
+        for (; p < end; p = nl + 1) {
+                nl = memchr(p, '\n', end - p);
+                if (nl == NULL)
+                        nl = end - 1;
+                /* Line without timestamp goes with the previous one */
+                if (parse_trace_ts(p, nl - p, &ns) == 0)
+                        in = ns >= from && ns <= to;
+                if (in)
+                        fwrite(p, 1, nl - p + 1, stdout);
+        }
+}
+
+/*
+ * query_scan -- a file without index, e.g. from a crash: decode it all.
+ */
+int query_scan(const char *file, long long from, long long to)
+{
+        gzFile gz = gzopen(file, "rb");
+        char *buf;
+        size_t keep = 0;
+        int n;
+        char *nl;
+
+        buf = malloc(TBUF_SZ);
+        if (gz == NULL || buf == NULL) {
+                free(buf);
+                return -1;
+        }
+        while ((n = gzread(gz, buf + keep, TBUF_SZ - keep)) > 0) {
+                n += keep;
+                nl = memrchr(buf, '\n', n);
+                if (nl == NULL) {
+                        /* Line longer than buffer, take it as is */
+                        nl = buf + n - 1;
+                }
+                query_lines(buf, nl - buf + 1, from, to);
+                keep = buf + n - nl - 1;
+                memmove(buf, nl + 1, keep);
+        }
+        if (keep)
+                query_lines(buf, keep, from, to);
+        gzclose(gz);
+        free(buf);
+        return 0;
+}
+
+/*
+ * query_file -- print lines in [from, to] of a segment file, decode only
+ *               the blocks which overlap the range.
+ */
+int query_file(const char *file, long long from, long long to)
+{
+        struct seg_trailer t;
+        struct seg_entry *idx = NULL;
+        char *cbuf = NULL, *rbuf = NULL;
+        z_stream zs;
+        struct stat st;
+        uint64_t i;
+        int fd, ret = -1;
+
+        fd = open(file, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        if (fstat(fd, &st) || st.st_size < (off_t)sizeof(t) ||
+            pread(fd, &t, sizeof(t), st.st_size - sizeof(t)) != sizeof(t) ||
+            memcmp(t.magic, SEG_MAGIC, sizeof(t.magic)) ||
+            t.index_off + t.nr_entries * sizeof(*idx) + sizeof(t) != (uint64_t)st.st_size) {
+                close(fd);
+                dprintf(INFO, "%s: no index, scan it\n", file);
+                return query_scan(file, from, to);
+        }
+
+        idx = malloc(t.nr_entries * sizeof(*idx) + 1);
+        if (idx == NULL || pread(fd, idx, t.nr_entries * sizeof(*idx), t.index_off) !=
+            (ssize_t)(t.nr_entries * sizeof(*idx)))
+                goto out;
+
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+                goto out;
+
+        for (i = 0; i < t.nr_entries; i++) {
+                struct seg_entry *e = &idx[i];
+
+                if ((long long)e->last_ns < from || (long long)e->first_ns > to)
+                        continue;
+                dprintf(DEBG, "%s: block %lu at %lu, cpu%d\n", file,
+                        (unsigned long)i, (unsigned long)e->off, (int)e->cpu);
+
+                free(cbuf);
+                free(rbuf);
+                cbuf = malloc(e->clen);
+                rbuf = malloc(e->rlen);
+                if (cbuf == NULL || rbuf == NULL ||
+                    pread(fd, cbuf, e->clen, e->off) != e->clen)
+                        break;
+
+                if (t.flags & SEG_COMPRESSED) {
+                        inflateReset(&zs);
+                        zs.next_in = (Bytef *)cbuf;
+                        zs.avail_in = e->clen;
+                        zs.next_out = (Bytef *)rbuf;
+                        zs.avail_out = e->rlen;
+                        if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+                                dprintf(ERR, "%s: bad block at %lu\n", file,
+                                        (unsigned long)e->off);
+                                continue;
+                        }
+                        query_lines(rbuf, e->rlen, from, to);
+                } else {
+                        query_lines(cbuf, e->clen, from, to);
+                }
+        }
+        inflateEnd(&zs);
+        ret = i == t.nr_entries ? 0 : -1;
+out:
+        free(cbuf);
+        free(rbuf);
+        free(idx);
+        close(fd);
+        return ret;
+}
+
+/*
+ * parse_sec_ns -- parse seconds at s into nanoseconds, clamping inf and
+ *                 out of range values to the long long range.
+ */
+static int parse_sec_ns(const char *s, char **end, long long *ns)
+{
+        double d = strtod(s, end) * 1e9;
+
+        if (*end == s || isnan(d))
+                return -1;
+        if (d >= (double)LLONG_MAX)
+                *ns = LLONG_MAX;
+        else if (d <= (double)LLONG_MIN)
+                *ns = LLONG_MIN;
+        else
+                *ns = d;
+        return 0;
+}
+
+/*
+ * query -- print lines in "from,to" (trace clock seconds) from the
+ *          rotated logs, oldest first, and the current one.
+ */
+int query(const char *range)
+{
+        char file[PATH_MAX], *end;
+        struct retain r = { 0 };
+        long long from, to;
+        unsigned long i;
+
+        if (parse_sec_ns(range, &end, &from) || *end != ',')
+                return -1;
+        if (parse_sec_ns(end + 1, &end, &to) || *end || to < from)
+                return -1;
+
+        retain_scan(&r, log_file, suffix);
+        for (i = 0; i < r.nr; i++) {
+                if (retain_name(file, log_file, retain_at(&r, i), suffix) ||
+                    query_file(file, from, to))
+                        dprintf(WARN, "Failed to query %s\n", file);
+        }
+        free(r.e);
+        snprintf(file, PATH_MAX, "%s%s", log_file, suffix);
+        if (access(file, R_OK) == 0 && query_file(file, from, to))
+                dprintf(WARN, "Failed to query %s\n", file);
+        return 0;
+}
+
+/*
+ * read_cpu_stats -- get "overrun" and "dropped events" of a cpu ring
+ *                   buffer from per_cpu/cpuN/stats.
+ */
+int read_cpu_stats(int cpu, unsigned long *overrun, unsigned long *dropped)
+{
+        char path[PATH_MAX], line[128];
+        FILE *fp;
+
+        if (snprintf(path, PATH_MAX, "%s/per_cpu/cpu%d/stats",
+                     tracing_dir, cpu) >= PATH_MAX)
+                return -1;
+        fp = fopen(path, "r");
+        if (fp == NULL)
+                return -1;
+
+        *overrun = *dropped = 0;
+        while (fgets(line, sizeof(line), fp)) {
+                if (!strncmp(line, "overrun:", 8))
+                        *overrun = strtoul(line + 8, NULL, 10);
+                else if (!strncmp(line, "dropped events:", 15))
+                        *dropped = strtoul(line + 15, NULL, 10);
+        }
+        fclose(fp);
+        return 0;
+}
+
+static int ctl_read(const char *file, char *buf, size_t sz)
+{
+        char path[PATH_MAX];
+        ssize_t n;
+        int fd;
+
+        if (snprintf(path, PATH_MAX, "%s/%s", tracing_dir, file) >= PATH_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        n = read(fd, buf, sz - 1);
+        close(fd);
+        if (n < 0)
+                return -1;
+        while (n > 0 && buf[n - 1] == '\n')
+                n--;
+        buf[n] = '\0';
+        return 0;
+}
+
+static int ctl_write(const char *file, const char *val)
+{
+        char path[PATH_MAX];
+        size_t len = strlen(val);
+        int fd, ret;
+
+        if (snprintf(path, PATH_MAX, "%s/%s", tracing_dir, file) >= PATH_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        fd = open(path, O_WRONLY|O_TRUNC);
+        if (fd < 0)
+                return -1;
+        ret = write(fd, val, len) == (ssize_t)len ? 0 : -1;
+        close(fd);
+        if (ret)
+                dprintf(ERR, "Failed to write \"%s\" to %s(%s)\n", val, path,
+                        strerror(errno));
+        return ret;
+}
+
+/*
+ * ctl_old_value -- turn what a file reads back into what restores it.
+ */
+static void ctl_old_value(const char *file, char *old)
+{
+        const char *base = strrchr(file, '/');
+
+        base = base ? base + 1 : file;
+        /* "7 (expanded: 1408)" */
+        if (!strcmp(base, "buffer_size_kb"))
+                old[strspn(old, "0123456789")] = '\0';
+        /* "none" or "### global filter ###..." means no filter */
+        else if (!strcmp(base, "filter") && (!strcmp(old, "none") || old[0] == '#'))
+                strcpy(old, "0");
+}
+
+/*
+ * ctl_add -- queue a setting, the last value of a file wins.
+ */
+int ctl_add(const char *file, const char *val)
+{
+        struct ctl_setting *c;
+        int i;
+
+        for (i = 0; i < ctl_nr; i++) {
+                if (!strcmp(ctl_settings[i].file, file)) {
+                        free(ctl_settings[i].val);
+                        ctl_settings[i].val = strdup(val);
+                        return 0;
+                }
+        }
+
+        c = realloc(ctl_settings, (ctl_nr + 1) * sizeof(*c));
+        if (c == NULL)
+                return -1;
+        ctl_settings = c;
+        c = &ctl_settings[ctl_nr++];
+        memset(c, 0, sizeof(*c));
+        snprintf(c->file, PATH_MAX, "%s", file);
+        c->val = strdup(val);
+        return 0;
+}
+
+/*
+ * ctl_load -- read the conf file of -P, see the format above.
+ */
+int ctl_load(const char *fn)
+{
+        char line[CTL_VAL_MAX], file[PATH_MAX], *key, *arg, *p;
+        int lineno = 0, ret = 0;
+        FILE *fp;
+
+        fp = fopen(fn, "r");
+        if (fp == NULL)
+                return -1;
+
+        while (ret == 0 && fgets(line, sizeof(line), fp)) {
+                lineno++;
+                if ((p = strchr(line, '#')))
+                        *p = '\0';
+                line[strcspn(line, "\n")] = '\0';
+                key = line + strspn(line, " \t");
+                if (*key == '\0')
+                        continue;
+                arg = key + strcspn(key, " \t");
+                if (*arg)
+                        *arg++ = '\0';
+                arg += strspn(arg, " \t");
+                for (p = arg + strlen(arg); p > arg && isspace(p[-1]); )
+                        *--p = '\0';
+
+                if (*arg == '\0') {
+                        ret = -1;
+                } else if (!strcmp(key, "buffer_size_kb") ||
+                           !strcmp(key, "tracing_cpumask")) {
+                        ret = ctl_add(key, arg);
+                } else if (!strcmp(key, "event")) {
+                        snprintf(file, PATH_MAX, "events/%s/enable", arg);
+                        ret = ctl_add(file, "1");
+                } else if (!strcmp(key, "filter") || !strcmp(key, "set")) {
+                        p = arg + strcspn(arg, " \t");
+                        if (*p == '\0') {
+                                ret = -1;
+                                break;
+                        }
+                        *p++ = '\0';
+                        p += strspn(p, " \t");
+                        if (!strcmp(key, "filter"))
+                                snprintf(file, PATH_MAX, "events/%s/filter", arg);
+                        else
+                                snprintf(file, PATH_MAX, "%s", arg);
+                        ret = ctl_add(file, p);
+                } else if (!strcmp(key, "auto_buffer")) {
+                        auto_max_kb = strtoul(arg, NULL, 0);
+                        if (auto_max_kb == 0)
+                                auto_max_kb = AUTO_MAX_KB;
+                } else {
+                        ret = -1;
+                }
+        }
+        fclose(fp);
+        if (ret)
+                dprintf(ERR, "%s:%d: invalid setting\n", fn, lineno);
+        return ret;
+}
+
+/*
+ * ctl_restore -- write back the values before ctl_apply(), newest first.
+ */
+void ctl_restore(void)
+{
+        int i;
+
+        for (i = ctl_nr - 1; i >= 0; i--) {
+                if (!ctl_settings[i].applied)
+                        continue;
+                dprintf(DEBG, "Restore %s: %s\n", ctl_settings[i].file,
+                        ctl_settings[i].old);
+                ctl_write(ctl_settings[i].file, ctl_settings[i].old);
+                ctl_settings[i].applied = 0;
+        }
+}
+
+/*
+ * ctl_apply -- save the current value of every setting, then write them.
+ *              If one fails, the ones written are rolled back.
+ */
+int ctl_apply(void)
+{
+        char val[CTL_VAL_MAX];
+        int i;
+
+        /* auto_buffer starts from the current size if conf has none */
+        if (auto_max_kb && ctl_read("buffer_size_kb", val, sizeof(val)) == 0) {
+                ctl_old_value("buffer_size_kb", val);
+                for (i = 0; i < ctl_nr; i++)
+                        if (!strcmp(ctl_settings[i].file, "buffer_size_kb"))
+                                break;
+                if (i == ctl_nr && ctl_add("buffer_size_kb", val))
+                        return -1;
+        }
+
+        for (i = 0; i < ctl_nr; i++) {
+                if (ctl_read(ctl_settings[i].file, ctl_settings[i].old,
+                             CTL_VAL_MAX)) {
+                        dprintf(ERR, "Can not read %s/%s\n", tracing_dir,
+                                ctl_settings[i].file);
+                        return -1;
+                }
+                ctl_old_value(ctl_settings[i].file, ctl_settings[i].old);
+        }
+
+        for (i = 0; i < ctl_nr; i++) {
+                dprintf(DEBG, "Set %s: %s => %s\n", ctl_settings[i].file,
+                        ctl_settings[i].old, ctl_settings[i].val);
+                if (ctl_write(ctl_settings[i].file, ctl_settings[i].val)) {
+                        ctl_restore();
+                        return -1;
+                }
+                ctl_settings[i].applied = 1;
+                if (!strcmp(ctl_settings[i].file, "buffer_size_kb"))
+                        buffer_kb = strtoul(ctl_settings[i].val, NULL, 10);
+        }
+
+        atexit(ctl_restore);
+        ctl_last = now_sec();
+        return 0;
+}
+
+/*
+ * ctl_autosize -- grow buffer_size_kb to hold AUTO_SECS of the drain rate
+ *                 per cpu, or double it when the kernel lost events.
+ *                 bytes is what the readers got so far; text is larger
+ *                 than the ring buffer records, which errs on the big
+ *                 side.
+ */
+void ctl_autosize(size_t bytes)
+{
+        unsigned long overrun, dropped, lost = 0, want;
+        long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        double now = now_sec(), rate;
+        char val[32];
+        int cpu;
+
+        if (!auto_max_kb || now - ctl_last < STATS_INTERVAL)
+                return;
+
+        /* A counter going backwards gives no rate, start over from it */
+        if (bytes < ctl_bytes) {
+                ctl_bytes = bytes;
+                ctl_last = now;
+                return;
+        }
+        rate = (bytes - ctl_bytes) / (now - ctl_last) / nr_cpus;
+        ctl_bytes = bytes;
+        ctl_last = now;
+
+        for (cpu = 0; cpu < nr_cpus; cpu++)
+                if (read_cpu_stats(cpu, &overrun, &dropped) == 0)
+                        lost += overrun + dropped;
+
+        want = rate * AUTO_SECS / 1024;
+        if (lost > ctl_lost && want < buffer_kb * 2)
+                want = buffer_kb * 2;
+        ctl_lost = lost;
+        if (want > auto_max_kb)
+                want = auto_max_kb;
+        if (want <= buffer_kb)
+                return;
+
+        snprintf(val, sizeof(val), "%lu", want);
+        dprintf(INFO, "buffer_size_kb: %lu => %lu (%.0f KB/s per cpu, lost %lu)\n",
+                buffer_kb, want, rate / 1024, lost);
+        if (ctl_write("buffer_size_kb", val) == 0) {
+                buffer_kb = want;
+                ctl_add("buffer_size_kb", val);
+        }
+}
+
+/*
+ * read_trace_pipe -- drain trace_pipe into buffers until EOF or a signal.
+ */
+void read_trace_pipe(void)
+{
+        struct pollfd pfd = { .fd = ftrace_fd, .events = POLLIN };
+        struct tbuf *cur = spsc_pop(&free_ring);
+        char *scratch = NULL;
+        int line_start = 1;
+        size_t total_read = 0;
+        ssize_t n;
+        int ret;
+
+        cur->len = 0;
+        if (timestamp && (scratch = malloc(READ_MIN)) == NULL) {
+                dprintf(ERR, "Failed to alloc read buffer\n");
+                exit(-1);
+        }
+
+        while (!stop) {
+                ret = poll(&pfd, 1, FLUSH_MS);
+                if (ret < 0 && errno == EINTR)
+                        continue;
+                /* Idle, let the writer have what we have */
+                if (ret == 0) {
+                        cur = hand_over(cur);
+                        ctl_autosize(total_read);
+                        continue;
+                }
+
+                if (timestamp) {
+                        n = read(ftrace_fd, scratch, READ_MIN);
+                } else {
+                        if (TBUF_SZ - cur->len < READ_MIN)
+                                cur = hand_over(cur);
+                        n = read(ftrace_fd, cur->data + cur->len,
+                                 TBUF_SZ - cur->len);
+                }
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0) {
+                        dprintf(ERR, "Failed to read %s(%s)\n", ftrace_pipe,
+                                strerror(errno));
+                        break;
+                }
+                if (n == 0)
+                        break;
+
+                if (timestamp)
+                        cur = stamp_lines(cur, scratch, n, &line_start);
+                else
+                        cur->len += n;
+                total_read += n;
+                mt.read_bytes = total_read;
+                ctl_autosize(total_read);
+        }
+
+        hand_over(cur);
+        free(scratch);
+}
+
+static void write_out(const char *data, size_t len)
+{
+        if (segment)
+                seg_write(data, len);
+        else
+                log_write(data, len);
+}
+
+static inline unsigned int agg_hashfn(const char *s, size_t len)
+{
+        unsigned int h = 2166136261u;   /* FNV-1a */
+
+        while (len--)
+                h = (h ^ (unsigned char)*s++) * 16777619u;
+        return h;
+}
+
+static struct agg_slot *agg_lookup(const char *event, size_t len, int add)
+{
+        unsigned int i = agg_hashfn(event, len) & (AGG_HASH_SZ - 1);
+        struct agg_slot *slot;
+        int n;
+
+        for (n = 0; n < AGG_HASH_SZ; n++, i = (i + 1) & (AGG_HASH_SZ - 1)) {
+                slot = &agg_hash[i];
+                if (slot->event == NULL) {
+                        if (!add)
+                                return NULL;
+                        slot->event = event;
+                        slot->len = len;
+                        return slot;
+                }
+                if (slot->len == len && !memcmp(slot->event, event, len))
+                        return slot;
+        }
+        return NULL;
+}
+
+static void agg_free_rule(struct agg_rule *r)
+{
+        free(r->event);
+        free(r->field);
+        free(r->value);
+        free(r->hist_field);
+        free(r);
+}
+
+/*
+ * agg_parse_rule -- "action event [field=value] [hist_field]"
+ */
+struct agg_rule *agg_parse_rule(char **tok, int nr)
+{
+        struct agg_rule *r;
+        int i = 2;
+        char *p;
+
+        if (nr < 2 || nr > 4)
+                return NULL;
+        r = calloc(1, sizeof(*r));
+        if (r == NULL)
+                return NULL;
+
+        for (r->action = AGG_PASS; r->action <= AGG_HIST; r->action++)
+                if (!strcmp(tok[0], agg_actions[r->action]))
+                        break;
+        r->event = strdup(tok[1]);
+
+        if (i < nr && (p = strchr(tok[i], '='))) {
+                *p++ = '\0';
+                r->field = strdup(tok[i]);
+                r->value = strdup(p);
+                r->value_len = strlen(p);
+                if (r->value_len && p[r->value_len - 1] == '*') {
+                        r->prefix = 1;
+                        r->value_len--;
+                }
+                i++;
+        }
+        if (r->action == AGG_HIST && i < nr)
+                r->hist_field = strdup(tok[i++]);
+
+        /* Unknown action, extra token or hist without field */
+        if (r->action > AGG_HIST || i != nr ||
+            (r->action == AGG_HIST && r->hist_field == NULL)) {
+                agg_free_rule(r);
+                return NULL;
+        }
+        return r;
+}
+
+/*
+ * agg_load -- read the rule file of -F.
+ */
+int agg_load(const char *fn)
+{
+        char line[512], *tok[5], *p, *save;
+        struct agg_rule *r, **tail, **rules;
+        struct agg_slot *slot;
+        int nr, lineno = 0;
+        FILE *fp;
+
+        fp = fopen(fn, "r");
+        if (fp == NULL)
+                return -1;
+
+        while (fgets(line, sizeof(line), fp)) {
+                lineno++;
+                p = strchr(line, '#');
+                if (p)
+                        *p = '\0';
+                for (nr = 0, p = line; nr < 5; nr++, p = NULL)
+                        if ((tok[nr] = strtok_r(p, " \t\n", &save)) == NULL)
+                                break;
+                if (nr == 0)
+                        continue;
+
+                r = agg_parse_rule(tok, nr);
+                if (r == NULL) {
+                        dprintf(ERR, "%s:%d: invalid rule\n", fn, lineno);
+                        fclose(fp);
+                        return -1;
+                }
+
+                if (!strcmp(r->event, "*")) {
+                        tail = &agg_any;
+                } else {
+                        slot = agg_lookup(r->event, strlen(r->event), 1);
+                        if (slot == NULL) {
+                                dprintf(ERR, "%s:%d: too many events\n", fn, lineno);
+                                agg_free_rule(r);
+                                fclose(fp);
+                                return -1;
+                        }
+                        tail = &slot->rules;
+                }
+                while (*tail)
+                        tail = &(*tail)->next;
+                *tail = r;
+
+                rules = realloc(agg_rules, (agg_nr + 1) * sizeof(*rules));
+                if (rules == NULL) {
+                        fclose(fp);
+                        return -1;
+                }
+                agg_rules = rules;
+                agg_rules[agg_nr++] = r;
+        }
+        fclose(fp);
+        return 0;
+}
+
+/*
+ * find_field -- value of " field=" in the fields of an event, or NULL.
+ */
+static const char *find_field(const char *p, const char *end, const char *field,
+                              size_t *len)
+{
+        size_t flen = strlen(field);
+        const char *v;
+
+        while (p < end && (p = memmem(p, end - p, field, flen))) {
+                v = p + flen;
+                if ((p[-1] == ' ' || p[-1] == ':') && v < end && *v == '=') {
+                        for (p = ++v; p < end && *p != ' ' && *p != '\n'; p++)
+                                ;
+                        *len = p - v;
+                        return v;
+                }
+                p = v;
+        }
+        return NULL;
+}
+
+static int agg_match(struct agg_rule *r, const char *fields, const char *end)
+{
+        const char *v;
+        size_t len;
+
+        if (r->field == NULL)
+                return 1;
+        v = find_field(fields, end, r->field, &len);
+        if (v == NULL)
+                return 0;
+        if (r->prefix)
+                return len >= r->value_len && !memcmp(v, r->value, r->value_len);
+        return len == r->value_len && !memcmp(v, r->value, len);
+}
+
+static void agg_hist_add(struct agg_rule *r, const char *fields, const char *end)
+{
+        const char *v;
+        size_t len;
+        unsigned long long val;
+
+        v = find_field(fields, end, r->hist_field, &len);
+        if (v == NULL)
+                return;
+        val = strtoull(v, NULL, 0);
+        r->hist[val ? 64 - __builtin_clzll(val) : 0]++;
+}
+
+/*
+ * agg_line -- run the rules on a line, return 1 if it goes to the log.
+ */
+int agg_line(const char *line, const char *end)
+{
+        struct agg_slot *slot;
+        struct agg_rule *r;
+        const char *ev, *c;
+        long long ns;
+
+        ev = find_trace_ts(line, end - line, &ns);
+        if (ev == NULL)
+                return 1;
+        c = memchr(ev, ':', end - ev);
+        if (c == NULL)
+                return 1;
+
+        slot = agg_lookup(ev, c - ev, 0);
+        for (r = slot ? slot->rules : NULL; r; r = r->next)
+                if (agg_match(r, c, end))
+                        goto found;
+        for (r = agg_any; r; r = r->next)
+                if (agg_match(r, c, end))
+                        goto found;
+        return 1;
+
+found:
+        r->count++;
+        if (r->action == AGG_HIST)
+                agg_hist_add(r, c, end);
+        return r->action == AGG_PASS;
+}
+
+/*
+ * agg_summary -- write counters and histograms to the log and reset them.
+ */
+size_t agg_summary(void)
+{
+        char buf[4096], tbuf[32];
+        struct agg_rule *r;
+        time_t now = time(NULL);
+        struct tm tm;
+        size_t written = 0;
+        int i, b, n;
+
+        localtime_r(&now, &tm);
+        strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
 
+        n = snprintf(buf, sizeof(buf), "# summary %s passed=%lu dropped=%lu\n",
+                     tbuf, agg_passed, agg_dropped);
+        write_out(buf, n);
+        written += n;
+        agg_passed = agg_dropped = 0;
 
-#define VERSION "2023.03.07"
+        for (i = 0; i < agg_nr; i++) {
+                r = agg_rules[i];
+                n = snprintf(buf, sizeof(buf), "# summary %s %s %s", tbuf,
+                             agg_actions[r->action], r->event);
+                if (r->field)
+                        n += snprintf(buf + n, sizeof(buf) - n, " %s=%.*s%s",
+                                      r->field, (int)r->value_len, r->value,
+                                      r->prefix ? "*" : "");
+                n += snprintf(buf + n, sizeof(buf) - n, " count=%lu", r->count);
+                if (r->action == AGG_HIST) {
+                        n += snprintf(buf + n, sizeof(buf) - n, " log2(%s)", r->hist_field);
+                        for (b = 0; b < AGG_BUCKETS; b++)
+                                if (r->hist[b])
+                                        n += snprintf(buf + n, sizeof(buf) - n, " %llu:%lu",
+                                                      b ? 1ULL << (b - 1) : 0, r->hist[b]);
+                }
+                buf[n++] = '\n';
+                write_out(buf, n);
+                written += n;
+                r->count = 0;
+                memset(r->hist, 0, sizeof(r->hist));
+        }
+        agg_last = now_sec();
+        return written;
+}
 
-void usage(char *err_msg)
+/*
+ * agg_filter -- run the rules on one whole line, write it if it passes.
+ */
+static size_t agg_filter(const char *line, const char *nl)
 {
-        if (err_msg)
-                fprintf(stderr, "[ERROR]: %s\n", err_msg);
+        if (!agg_line(line, nl)) {
+                agg_dropped++;
+                return 0;
+        }
+        agg_passed++;
+        write_out(line, nl - line + 1);
+        return nl - line + 1;
+}
 
-        fprintf(stderr, "Usage: %s [OPTION]...\n", prog);
-        fprintf(stderr, "Version: %s\n\n", VERSION);        
-        fprintf(stderr, "    -c            : Compress the log. Default: enabled\n");
-        fprintf(stderr, "    -d dbg_lvl    : Set debug log level. Default: 2. {0: Debug, 1: Info, 2: Warn, 3: error}!\n");
-        fprintf(stderr, "    -f            : Start it on forground\n");
-        fprintf(stderr, "    -h|H          : Print this message!\n");
-        fprintf(stderr, "    -n nr_log     : Max number of log files to be saved. Default: 10, max: 10.\n");
-        fprintf(stderr, "    -p log_path   : Path to save log file. Default: /var/log/ftrace\n");
-        fprintf(stderr, "    -s log_filesz : Log file size, Default: 100M, max 4096M.\n");
-        fprintf(stderr, "    -t            : Add wallclock to the log. default: disabled\n");
-        fprintf(stderr, "                  : [WARN]: The timestamp may not matched with log produce time\n");
-        fprintf(stderr, "\n\n");
+static char *carry;                     /* Line split between buffers */
+static size_t carry_len, carry_sz;
 
-        if (err_msg)
-                exit(-1);
-        exit(0);
+/*
+ * agg_write -- write the lines of data the rules pass, as runs. A line
+ *              split between two buffers is kept until its end comes.
+ */
+size_t agg_write(const char *data, size_t len)
+{
+        const char *p = data, *end = data + len, *nl, *run;
+        size_t written = 0, n;
+        char *tmp;
+
+        /* Finish the line left by the previous buffer */
+        if (carry_len) {
+                nl = memchr(p, '\n', len);
+                n = nl ? nl - p + 1 : len;
+                if (carry_len + n > carry_sz) {
+                        tmp = realloc(carry, carry_len + n);
+                        if (tmp == NULL) {
+                                dprintf(ERR, "Failed to alloc line buffer\n");
+                                exit(-1);
+                        }
+                        carry = tmp;
+                        carry_sz = carry_len + n;
+                }
+                memcpy(carry + carry_len, p, n);
+                carry_len += n;
+                if (nl == NULL)
+                        return 0;
+                written += agg_filter(carry, carry + carry_len - 1);
+                carry_len = 0;
+                p = nl + 1;
+        }
+
+        for (run = p; p < end; p = nl + 1) {
+                nl = memchr(p, '\n', end - p);
+                if (nl == NULL)
+                        break;
+                if (agg_line(p, nl)) {
+                        agg_passed++;
+                        continue;
+                }
+                agg_dropped++;
+                if (p > run) {
+                        write_out(run, p - run);
+                        written += p - run;
+                }
+                run = nl + 1;
+        }
+        if (p > run) {
+                write_out(run, p - run);
+                written += p - run;
+        }
+
+        /* Partial line at the end */
+        if (p < end) {
+                n = end - p;
+                if (n > carry_sz) {
+                        tmp = realloc(carry, n);
+                        if (tmp == NULL) {
+                                dprintf(ERR, "Failed to alloc line buffer\n");
+                                exit(-1);
+                        }
+                        carry = tmp;
+                        carry_sz = n;
+                }
+                memcpy(carry, p, n);
+                carry_len = n;
+        }
+        return written;
 }
 
-int validate_and_set_path(char *path, char *dest, int mode)
+/*
+ * agg_flush -- end the line kept by agg_write(), the trace stopped in it.
+ */
+size_t agg_flush(void)
 {
-        /* Path is too long */
-        if (strlen(path) > PATH_MAX - 1)
-                return -1;
+        return carry_len ? agg_write("\n", 1) : 0;
+}
 
-        /* Validate file permission */
-        if (access(path, mode) != 0)
-                return -1;
+static size_t log_data(const char *data, size_t len)
+{
+        if (agg_nr)
+                return agg_write(data, len);
+        write_out(data, len);
+        return len;
+}
 
-        dprintf(DEBG, "File %s permission %d is ok!\n", path, mode);
+static unsigned long count_lines(const char *p, size_t len)
+{
+        const char *end = p + len;
+        unsigned long n = 0;
 
-        /* Validate the path permission only */
-        if (dest == NULL)
-                return 0;
+        while ((p = memchr(p, '\n', end - p))) {
+                n++;
+                p++;
+        }
+        return n;
+}
 
-        /* Copy the path to destention */
-        strncpy(dest, path, PATH_MAX);
+/*
+ * log_writer -- write buffers queued by the reader and rotate the log.
+ *               Rotation is done at the last line end of a buffer, so
+ *               each log holds whole lines.
+ */
+void *log_writer(void *arg)
+{
+        size_t total_write = *(size_t *)arg;
+        struct tbuf *b;
+        const char *data, *nl;
+        size_t len, n, room;
+        struct timespec ts;
+        int due, eol = 1;
 
-        return 0;
+        for (;;) {
+                b = spsc_pop(&full_ring);
+                if (b == NULL) {
+                        if (__atomic_load_n(&reader_done, __ATOMIC_ACQUIRE) &&
+                            spsc_count(&full_ring) == 0)
+                                break;
+                        /* Sync, summaries and -i are due on an idle trace too */
+                        clock_gettime(CLOCK_REALTIME, &ts);
+                        ts.tv_sec++;
+                        sem_timedwait(&full_sem, &ts);
+                        log_sync();
+                        if (agg_nr && now_sec() - agg_last >= agg_interval)
+                                total_write += agg_summary();
+                        if (rotate_secs && total_write && eol &&
+                            now_sec() - last_rotate >= rotate_secs) {
+                                if (segment)
+                                        seg_finish();
+                                do_rotate_and_compress(total_write);
+                                total_write = 0;
+                        }
+                        continue;
+                }
+
+                data = b->data;
+                len = b->len;
+
+                /*
+                 * Do log rotate and compress, at the last line end within
+                 * -s, or of the buffer if -i is due. Only a line crossing
+                 * the limit alone is kept whole past it.
+                 */
+                due = rotate_secs && now_sec() - last_rotate >= rotate_secs;
+                while (len && (due || total_write + len > max_filesz)) {
+                        room = total_write < max_filesz ? max_filesz - total_write : 0;
+                        if (due || room > len)
+                                room = len;
+                        nl = memrchr(data, '\n', room);
+                        if (nl == NULL)
+                                nl = memchr(data + room, '\n', len - room);
+                        if (nl == NULL)
+                                break;
+                        n = nl - data + 1;
+                        total_write += log_data(data, n);
+                        data += n;
+                        len -= n;
+                        due = 0;
+
+                        dprintf(DEBG, "total_write: %lu\n", total_write);
+                        if (segment)
+                                seg_finish();
+                        /* Rotate */
+                        do_rotate_and_compress(total_write);
+                        total_write = 0;
+                }
+
+                total_write += log_data(data, len);
+                if (len)
+                        eol = data[len - 1] == '\n';
+                tbufs_written++;
+                if (metrics_file)
+                        mt.lines += count_lines(b->data, b->len);
+                spsc_push(&free_ring, b);
+                log_sync();
+
+                if (agg_nr && now_sec() - agg_last >= agg_interval)
+                        total_write += agg_summary();
+        }
+        if (agg_nr) {
+                agg_flush();
+                agg_summary();
+        }
+        if (segment)
+                seg_finish();
+        return NULL;
 }
 
-int set_max_filesz(char *s_sz)
+/*
+ * metrics_write -- rewrite the stats file, by rename so readers never
+ *                  see a partial one.
+ */
+void metrics_write(void)
 {
-        if (!s_sz || !strlen(s_sz))
-                return -1;
+        static unsigned long last_bytes, last_lines;
+        static double last;
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        char tmp[PATH_MAX];
+        unsigned long bytes = 0, lines = mt.lines, overrun, dropped;
+        double now = now_sec(), elapsed = now - last;
+        long nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+        FILE *fp;
+        int i;
 
-        switch(s_sz[strlen(s_sz) - 1]) {
-                case 'k':
-                case 'K':
-                        max_filesz = atol(s_sz) << 10;
-                        break;
-                case 'm':
-                case 'M':
-                        max_filesz = atol(s_sz) << 20;
-                        break;
-                /* Bytes */
-                case 'b':
-                case 'B':
-                case '0' ... '9':
-                        max_filesz = atol(s_sz);
-                        break;
-                default:
-                        return -1;
+        if (raw_mode) {
+                for (i = 0; i < nr_raw_cpus; i++)
+                        bytes += raw_cpus[i].bytes;
+        } else {
+                bytes = mt.read_bytes;
         }
-        dprintf(DEBG, "max_filesz: %ld\n", max_filesz);
-        return ((max_filesz <= 0 || (max_filesz >> 30) > 4) ? -1 : 0);
+
+        pthread_mutex_lock(&lock);
+        if (last == 0)
+                elapsed = now - start_time;
+        snprintf(tmp, PATH_MAX, "%s.tmp", metrics_file);
+        fp = fopen(tmp, "w");
+        if (fp == NULL)
+                goto out;
+
+        fprintf(fp, "ftrace_log_read_bytes_total %lu\n", bytes);
+        fprintf(fp, "ftrace_log_read_bytes_per_second %.0f\n",
+                (bytes - last_bytes) / elapsed);
+        if (!raw_mode) {
+                fprintf(fp, "ftrace_log_lines_total %lu\n", lines);
+                fprintf(fp, "ftrace_log_lines_per_second %.0f\n",
+                        (lines - last_lines) / elapsed);
+                fprintf(fp, "ftrace_log_queue_depth %u\n", spsc_count(&full_ring));
+                fprintf(fp, "ftrace_log_queue_high_water %u\n", tbufs_hwm);
+                fprintf(fp, "ftrace_log_queue_buffers %lu\n", nr_tbufs);
+                fprintf(fp, "ftrace_log_dropped_buffers_total %lu\n", tbufs_dropped);
+                fprintf(fp, "ftrace_log_log_in_bytes_total %lu\n", mt.log_in);
+                fprintf(fp, "ftrace_log_log_out_bytes_total %lu\n", mt.log_out);
+                fprintf(fp, "ftrace_log_compression_ratio %.2f\n",
+                        mt.log_out ? (double)mt.log_in / mt.log_out : 0);
+        }
+        fprintf(fp, "ftrace_log_rotations_total %lu\n", mt.rotations);
+        fprintf(fp, "ftrace_log_rotation_last_ms %.3f\n", mt.rotate_last_ms);
+        fprintf(fp, "ftrace_log_rotation_max_ms %.3f\n", mt.rotate_max_ms);
+
+        for (i = 0; i < nr_cpus; i++) {
+                if (read_cpu_stats(i, &overrun, &dropped))
+                        continue;
+                fprintf(fp, "ftrace_log_cpu_overrun_total{cpu=\"%d\"} %lu\n", i, overrun);
+                fprintf(fp, "ftrace_log_cpu_dropped_events_total{cpu=\"%d\"} %lu\n", i, dropped);
+        }
+        if (raw_mode)
+                for (i = 0; i < nr_raw_cpus; i++)
+                        fprintf(fp, "ftrace_log_cpu_read_bytes_total{cpu=\"%d\"} %lu\n",
+                                raw_cpus[i].cpu, raw_cpus[i].bytes);
+
+        if (fclose(fp) == 0)
+                rename(tmp, metrics_file);
+        last_bytes = bytes;
+        last_lines = lines;
+        last = now;
+out:
+        pthread_mutex_unlock(&lock);
 }
 
-int open_logfile(void)
+void *metrics_thread(void *arg)
+{
+        while (!stop) {
+                sleep(METRICS_INTERVAL);
+                metrics_write();
+        }
+        return NULL;
+}
+
+/*
+ * metrics_start -- run metrics_thread() with signals blocked.
+ */
+void metrics_start(void)
+{
+        pthread_t thread;
+        sigset_t set, old;
+
+        start_time = now_sec();
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+        if (pthread_create(&thread, NULL, metrics_thread, NULL) == 0)
+                pthread_detach(thread);
+        else
+                dprintf(WARN, "Failed to start metrics thread\n");
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * text_capture -- run log_writer() and read trace_pipe on this thread.
+ */
+int text_capture(size_t total_write)
 {
-        log_fp = fopen(log_file, "a+");
-        if (log_fp == NULL) {
-                dprintf(ERR, "Can not open logfile %s\n", log_file);
+        pthread_t writer;
+        sigset_t set, old;
+
+        /* Signals go to the reader only */
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+        if (pthread_create(&writer, NULL, log_writer, &total_write)) {
+                dprintf(ERR, "Failed to start writer\n");
                 exit(-1);
         }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        read_trace_pipe();
+
+        __atomic_store_n(&reader_done, 1, __ATOMIC_RELEASE);
+        sem_post(&full_sem);
+        pthread_join(writer, NULL);
+
+        dprintf(WARN, "Buffers: %lu written, %lu dropped, high water %u/%lu\n",
+                tbufs_written, tbufs_dropped, tbufs_hwm, nr_tbufs);
         return 0;
 }
 
-void do_rotate_and_compress(void)
+/*
+ * raw_report -- print events lost by each cpu since capture started.
+ */
+void raw_report(int lvl)
 {
+        unsigned long overrun, dropped, lost = 0;
         int i;
-        char cur_file[PATH_MAX], new_file[PATH_MAX];
-        char cmd[PATH_MAX];
-
-        /* Close log file */
-        if (log_fp) {
-                fclose(log_fp);
-                log_fp = NULL;
-        }
 
-        /* In rotating, remove the oldest logfile */
-        snprintf(cur_file, PATH_MAX, "%s.%lu.%s", log_file, nr_logs - 1, suffix);
-        dprintf(DEBG, "Remove %s\n", cur_file);
-        remove(cur_file);
+        for (i = 0; i < nr_raw_cpus; i++) {
+                struct raw_cpu *rc = &raw_cpus[i];
 
-        for (i = nr_logs - 2; i >= 0; i--) {
-                snprintf(cur_file, PATH_MAX, "%s.%d.%s", log_file, i, suffix);
-                if (access(cur_file, R_OK|W_OK) != 0)
+                if (read_cpu_stats(rc->cpu, &overrun, &dropped))
                         continue;
-                snprintf(new_file, PATH_MAX, "%s.%d.%s", log_file, i + 1, suffix);
-                dprintf(DEBG, "Rename %s => %s\n", cur_file, new_file);
-                if (rename(cur_file, new_file)) {
-                        dprintf(ERR, "Failed to rename file %s\n", cur_file);
-                        exit(-1);
-                }
+                overrun -= rc->base_overrun;
+                dropped -= rc->base_dropped;
+                lost += overrun + dropped;
+                dprintf(lvl, "cpu%d: written %lu overrun %lu dropped %lu\n",
+                        rc->cpu, rc->total_write, overrun, dropped);
         }
+        dprintf(lvl, "Lost events: %lu\n", lost);
+}
+
+int raw_open_out(struct raw_cpu *rc)
+{
+        off_t off;
+
+        /* splice() refuses O_APPEND, seek to the end instead */
+        rc->out_fd = open(rc->file, O_WRONLY|O_CREAT, 0644);
+        if (rc->out_fd < 0)
+                return -1;
+        off = lseek(rc->out_fd, 0, SEEK_END);
+        rc->total_write = off < 0 ? 0 : off;
+        return 0;
+}
+
+/*
+ * raw_check_rotate -- rotate a non-empty raw file past -s or -i.
+ */
+static void raw_check_rotate(struct raw_cpu *rc)
+{
+        if (rc->total_write == 0 ||
+            (rc->total_write <= max_filesz &&
+             !(rotate_secs && now_sec() - rc->last_rotate >= rotate_secs)))
+                return;
 
-        /* Rename current logfile to .0 */
-        snprintf(new_file, PATH_MAX, "%s.0", log_file);
-        dprintf(DEBG, "Rename %s => %s\n", log_file, new_file);
-        if (rename(log_file, new_file)) {
-                dprintf(ERR, "Failed to rename file %s\n", log_file);
+        close(rc->out_fd);
+        rotate_raw(rc);
+        if (raw_open_out(rc)) {
+                dprintf(ERR, "Failed to open %s(%s)\n", rc->file, strerror(errno));
                 exit(-1);
         }
+}
 
-        /* Compress the logfile */
-        snprintf(cmd, PATH_MAX, "%s %s", compress_cmd, new_file);
-        if (system(cmd) != 0) {
-                dprintf(ERR, "Faile to execut %s\n", cmd);
-                exit(-1);
+/*
+ * raw_reader -- move pages of a cpu ring buffer to its raw file, the
+ *               thread runs on that cpu so pages stay local.
+ */
+void *raw_reader(void *arg)
+{
+        struct raw_cpu *rc = arg;
+        cpu_set_t set;
+        ssize_t n, w;
+
+        CPU_ZERO(&set);
+        CPU_SET(rc->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+                dprintf(WARN, "Can not bind reader to cpu%d\n", rc->cpu);
+
+        for (;;) {
+                /* On stop, drain what is ready and leave */
+                if (!stop) {
+                        struct pollfd pfd = { rc->in_fd, POLLIN, 0 };
+
+                        /* -i is due on an idle cpu too */
+                        if (poll(&pfd, 1, RAW_POLL_MS) == 0) {
+                                raw_check_rotate(rc);
+                                continue;
+                        }
+                }
+                n = splice(rc->in_fd, NULL, rc->pipe[1], NULL, RAW_SPLICE_SZ,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n < 0 && (errno == EINTR || (errno == EAGAIN && !stop)))
+                        continue;
+                if (n < 0 && errno == EAGAIN)
+                        break;
+                if (n < 0) {
+                        dprintf(ERR, "cpu%d: splice from ring buffer failed(%s)\n",
+                                rc->cpu, strerror(errno));
+                        break;
+                }
+                /* Ring buffer file reached its end, only with a regular file */
+                if (n == 0)
+                        break;
+
+                while (n > 0) {
+                        w = splice(rc->pipe[0], NULL, rc->out_fd, NULL, n,
+                                   SPLICE_F_MOVE);
+                        if (w < 0 && errno == EINTR)
+                                continue;
+                        if (w <= 0) {
+                                dprintf(ERR, "cpu%d: splice to %s failed(%s)\n",
+                                        rc->cpu, rc->file, strerror(errno));
+                                exit(-1);
+                        }
+                        n -= w;
+                        rc->total_write += w;
+                        rc->bytes += w;
+                }
+
+                raw_check_rotate(rc);
         }
-        
-        /* Create new log file */
-        if (open_logfile() != 0) {
-                dprintf(ERR, "Failed to open %s(%s)\n", log_file, strerror(errno));
-                exit(-1);
+        return NULL;
+}
+
+/*
+ * raw_setup -- open ring buffer, pipe and output file of every cpu which
+ *              has a per_cpu/cpuN/trace_pipe_raw.
+ */
+int raw_setup(void)
+{
+        char path[PATH_MAX];
+        long nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+        int cpu;
+
+        raw_cpus = calloc(nr_cpus, sizeof(*raw_cpus));
+        if (raw_cpus == NULL)
+                return -1;
+
+        for (cpu = 0; cpu < nr_cpus; cpu++) {
+                struct raw_cpu *rc = &raw_cpus[nr_raw_cpus];
+
+                if (snprintf(path, PATH_MAX, "%s/per_cpu/cpu%d/trace_pipe_raw",
+                             tracing_dir, cpu) >= PATH_MAX)
+                        return -1;
+                rc->in_fd = open(path, O_RDONLY);
+                if (rc->in_fd < 0)
+                        continue;
+
+                rc->cpu = cpu;
+                if (snprintf(rc->file, PATH_MAX, "%s/%s.cpu%d.raw",
+                             log_path, prog, cpu) >= PATH_MAX) {
+                        dprintf(ERR, "cpu%d: log path is too long\n", cpu);
+                        return -1;
+                }
+                if (pipe(rc->pipe) || raw_open_out(rc)) {
+                        dprintf(ERR, "cpu%d: failed to setup %s(%s)\n",
+                                cpu, rc->file, strerror(errno));
+                        return -1;
+                }
+                fcntl(rc->pipe[1], F_SETPIPE_SZ, RAW_SPLICE_SZ);
+                if (retain_scan(&rc->retain, rc->file, suffix) == 0)
+                        retain_trim(&rc->retain, rc->file, suffix);
+                rc->last_rotate = now_sec();
+                read_cpu_stats(cpu, &rc->base_overrun, &rc->base_dropped);
+                dprintf(DEBG, "cpu%d: %s => %s\n", cpu, path, rc->file);
+                nr_raw_cpus++;
         }
 
-        return;
+        return nr_raw_cpus ? 0 : -1;
 }
 
-void sig_handler (int signum)
+/*
+ * raw_capture -- start readers and report lost events until a signal
+ *                arrives or every reader is gone.
+ */
+int raw_capture(void)
 {
-        dprintf(DEBG, "Got signal %d\n", signum);
-        if (log_fp) {
-                fflush(log_fp);
-                fclose(log_fp);
-                log_fp = NULL;
+        sigset_t set, old;
+        int i, running = 0;
+        size_t total;
+
+        /* Signals go to the main thread only */
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+        for (i = 0; i < nr_raw_cpus; i++) {
+                if (pthread_create(&raw_cpus[i].thread, NULL, raw_reader,
+                                   &raw_cpus[i])) {
+                        dprintf(ERR, "Failed to start reader of cpu%d\n",
+                                raw_cpus[i].cpu);
+                        exit(-1);
+                }
+                running++;
         }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-        if (ftrace_fp) {
-                fclose(ftrace_fp);
-                ftrace_fp = NULL;
+        while (!stop && running) {
+                sleep(STATS_INTERVAL);
+                raw_report(INFO);
+                for (i = 0, total = 0; i < nr_raw_cpus; i++)
+                        total += raw_cpus[i].bytes;
+                ctl_autosize(total);
+                for (i = 0, running = 0; i < nr_raw_cpus; i++) {
+                        struct raw_cpu *rc = &raw_cpus[i];
+
+                        if (!rc->joined)
+                                rc->joined = pthread_tryjoin_np(rc->thread, NULL) == 0;
+                        running += !rc->joined;
+                }
         }
 
-        unlink(pidfile);
+        /* Readers drain the ring buffers and pipes, then see stop */
+        stop = 1;
+        for (i = 0; i < nr_raw_cpus; i++)
+                if (!raw_cpus[i].joined)
+                        pthread_join(raw_cpus[i].thread, NULL);
+
+        raw_report(WARN);
+
+        /* No reader is left to start one, do not leave a truncated .gz */
+        for (i = 0; i < nr_raw_cpus; i++)
+                if (raw_cpus[i].compressing)
+                        pthread_join(raw_cpus[i].compressor, NULL);
+        return 0;
+}
+
+void sig_handler (int signum)
+{
+        dprintf(DEBG, "Got signal %d\n", signum);
 
-        exit(-1);
+        /* Let the capture loop flush, report and exit */
+        stop = 1;
 }
 
 void set_sigs(void)
@@ -224,20 +3110,26 @@ void set_sigs(void)
 int main(int argc, char **argv)
 {
         char opt;
-        char *line = NULL;
-        size_t len = 0;
-        ssize_t nread;
+        char *bench_file = NULL;
+        char *query_range = NULL;
+        char *conf_file = NULL;
         size_t total_write = 0;
-        time_t curtime;
-        char time_str[80];
+        char cur_file[PATH_MAX];
+        struct stat st;
 
 
-        /* Make sure ftrace has mounted to /sys/kernel/debug/tracing */
-        if (validate_and_set_path(ftrace_pipe, NULL, R_OK|W_OK) != 0)
-                usage("Can not find /sys/kernel/debug/tracing/trace_pipe");
-
-        while ((opt = getopt(argc, argv, "s:n:p:chHtd:f")) != -1) {
+        while ((opt = getopt(argc, argv, "a:A:b:B:s:n:p:cChHi:td:efF:k:M:P:rQ:R:ST:uz:O")) != -1) {
                 switch (opt) {
+                        case 'a':
+                                agg_interval = atoi(optarg);
+                                if (agg_interval <= 0)
+                                        usage("Invalid summary interval");
+                                break;
+                        case 'b':
+                                nr_tbufs = atoi(optarg);
+                                if (nr_tbufs < 2 || nr_tbufs > 65536)
+                                        usage("Invalid number of buffers");
+                                break;
                         case 's':
                                 if (set_max_filesz(optarg) != 0)
                                         usage("Invalid log file size");
@@ -247,15 +3139,69 @@ int main(int argc, char **argv)
                                 if (nr_logs <= 0 || nr_logs > MAX_LOGS)
                                         usage("Invalid NR_logs");
                                 break;
+                        case 'A':
+                                retain_secs = atol(optarg);
+                                if (retain_secs <= 0)
+                                        usage("Invalid max age");
+                                break;
+                        case 'i':
+                                rotate_secs = atol(optarg);
+                                if (rotate_secs <= 0)
+                                        usage("Invalid rotate interval");
+                                break;
+                        case 'R':
+                                if (parse_size(optarg) <= 0)
+                                        usage("Invalid retained size");
+                                retain_bytes = parse_size(optarg);
+                                break;
                         case 'p':
                                 if (validate_and_set_path(optarg, log_path, R_OK|W_OK) != 0)
                                         usage("Invalid log path!");
                                 break;
                         case 'c':
-                                compress = 1;
+                                do_compress = 1;
+                                break;
+                        case 'C':
+                                do_compress = 0;
+                                suffix = "";
+                                break;
+                        case 'z':
+                                compress_level = atoi(optarg);
+                                if (compress_level < 1 || compress_level > 9)
+                                        usage("Invalid compression level");
                                 break;
                         case 't':
-                                timestamp = 1;
+                                if (timestamp == TS_NONE)
+                                        timestamp = TS_WALL;
+                                break;
+                        case 'e':
+                                timestamp = TS_EVENT;
+                                break;
+                        case 'B':
+                                bench_file = optarg;
+                                break;
+                        case 'F':
+                                if (agg_load(optarg) != 0)
+                                        usage("Invalid filter rules");
+                                agg_last = now_sec();
+                                break;
+                        case 'k':
+                                seg_block = atol(optarg) << 10;
+                                if (seg_block < 4096 || seg_block > (64 << 20))
+                                        usage("Invalid block size");
+                                break;
+                        case 'M':
+                                if (set_metrics_file(optarg) != 0)
+                                        usage("Invalid metrics file");
+                                break;
+                        case 'P':
+                                conf_file = optarg;
+                                break;
+                        case 'Q':
+                                query_range = optarg;
+                                break;
+                        case 'S':
+                                segment = 1;
                                 break;
                         case 'd':
                                 debug_level = atoi(optarg);
@@ -265,36 +3211,107 @@ int main(int argc, char **argv)
                         case 'f':
                                 forground = 1;
                                 break;
+                        case 'r':
+                                raw_mode = 1;
+                                break;
+                        case 'u':
+                                use_uring = 1;
+                                break;
+                        case 'O':
+                                use_direct = 1;
+                                break;
+                        case 'T':
+                                if (validate_and_set_path(optarg, tracing_dir, R_OK) != 0)
+                                        usage("Invalid tracing path!");
+                                break;
                         case 'h':
                         default:
                                 usage(NULL);
                 }
         }
 
+        if (bench_file)
+                return bench_stamp(bench_file) ? -1 : 0;
+
+        if (query_range) {
+                if (snprintf(log_file, PATH_MAX, "%s/%s.log", log_path, prog) >= PATH_MAX)
+                        usage("Log path is too long");
+                if (query(query_range) != 0)
+                        usage("Invalid query range");
+                return 0;
+        }
+
+        /* Make sure ftrace has mounted to tracing_dir */
+        if (snprintf(ftrace_pipe, PATH_MAX, "%s/trace_pipe", tracing_dir) >= PATH_MAX ||
+            validate_and_set_path(ftrace_pipe, NULL, R_OK|W_OK) != 0)
+                usage("Can not find trace_pipe under tracing path");
+
         /* construct log_file with full path */
-        snprintf(log_file, PATH_MAX, "%s/%s.log", log_path, prog);
+        if (snprintf(log_file, PATH_MAX, "%s/%s.log", log_path, prog) >= PATH_MAX)
+                usage("Log path is too long");
         dprintf(DEBG, "***** Setting *****\n");
         dprintf(DEBG, "filesz: %ld\n", max_filesz);
         dprintf(DEBG, "nr_logs: %ld\n", nr_logs);
         dprintf(DEBG, "log_path: %s\n", log_path);
-        dprintf(DEBG, "compress_cmd: %s\n", compress_cmd);
+        dprintf(DEBG, "compress: %d level: %d\n", do_compress, compress_level);
+        dprintf(DEBG, "tracing_dir: %s\n", tracing_dir);
+        dprintf(DEBG, "raw_mode: %d\n", raw_mode);
+
+        /* Configure tracing, raw readers take the new cpu mask */
+        if (conf_file) {
+                if (ctl_load(conf_file) != 0)
+                        usage("Invalid tracing conf");
+                if (ctl_apply() != 0) {
+                        dprintf(ERR, "Failed to configure tracing\n");
+                        exit(-1);
+                }
+        }
+
+        if (raw_mode) {
+                if (raw_setup() != 0) {
+                        dprintf(ERR, "Failed to setup per-cpu trace_pipe_raw\n");
+                        exit(-1);
+                }
+                goto run;
+        }
+
+        if (retain_scan(&text_retain, log_file, suffix) == 0) {
+                retain_upgrade(&text_retain, log_file, suffix);
+                retain_trim(&text_retain, log_file, suffix);
+        }
+
+        /* A segment file ends with its index, never append to it */
+        snprintf(cur_file, PATH_MAX, "%s%s", log_file, suffix);
+        if (segment && stat(cur_file, &st) == 0 && st.st_size)
+                rotate_file(&text_retain, log_file, cur_file, suffix, suffix, NULL);
 
         if (open_logfile() != 0) {
                 dprintf(ERR, "Failed to open %s(%s)\n", log_file, strerror(errno));
                 exit(-1);
         }
 
-        /* Get current logfile size */
-        fseek(log_fp, 0, SEEK_END);
-        total_write = ftell(log_fp);
+        /* Get current logfile size, compressed bytes of an appended one */
+        snprintf(cur_file, PATH_MAX, "%s%s", log_file, suffix);
+        if (stat(cur_file, &st) == 0)
+                total_write = st.st_size;
         dprintf(DEBG, "total_write: %lu\n", total_write);
+        last_rotate = now_sec();
+
+        if (timestamp == TS_EVENT && ts_setup() != 0)
+                timestamp = TS_WALL;
+
+        if (tbuf_init() != 0) {
+                dprintf(ERR, "Failed to alloc %lu trace buffers\n", nr_tbufs);
+                exit(-1);
+        }
 
-        ftrace_fp = fopen(ftrace_pipe, "r");
-        if (ftrace_fp == NULL) {
+        ftrace_fd = open(ftrace_pipe, O_RDONLY);
+        if (ftrace_fd < 0) {
                 dprintf(ERR, "Failed to open %s(%s)\n", ftrace_pipe, strerror(errno));
                 exit(-1);
         }
 
+run:
         set_sigs();
 
         /* Run as daemon? */
@@ -316,28 +3333,22 @@ int main(int argc, char **argv)
                 }
         }
 
+        if (metrics_file)
+                metrics_start();
 
-
-        while ((nread = getline(&line, &len, ftrace_fp)) != -1) {
-                /* Write timestamp */
-                if (timestamp) {
-                        curtime = time(NULL);
-                        strncpy(time_str, ctime(&curtime), 80);
-                        time_str[strlen(time_str) - 1] = '\0';
-                        total_write += fprintf(log_fp, "%s:", time_str);
-                }
-                total_write += fprintf(log_fp, "%s", line);
-
-                /* Do log rotate and compress */
-                if (total_write > max_filesz) {
-                        dprintf(DEBG, "total_write: %lu\n", total_write);
-                        /* Rotate */
-                        do_rotate_and_compress();
-                        total_write = 0;
-                }
+        if (raw_mode) {
+                raw_capture();
+                if (metrics_file)
+                        metrics_write();
+                unlink(pidfile);
+                return 0;
         }
-        fclose(ftrace_fp);
-        fclose(log_fp);
+
+        text_capture(total_write);
+        close(ftrace_fd);
+        close_logfile();
+        if (metrics_file)
+                metrics_write();
         unlink(pidfile);
 
         return 0;
@@ -3,16 +3,103 @@
  *
  * Command for compile: gcc -Wall -o logfile_timestamp logfile_timestamp.c
  *
- * Usage: ./logfile_timestamp input_logfile output_logfile
+ * Usage: ./logfile_timestamp [-t fmt] input_logfile output_logfile [input output]...
+ *        ./logfile_timestamp [-t fmt] -m output_logfile input_logfile...
+ *        ./logfile_timestamp -b [lines]
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+
+#define BUF_SZ          (64 << 10)      /* Bytes per read */
+#define TS_MAX          128             /* Bytes of a timestamp prefix */
+#define OBUF_SZ         (2 * BUF_SZ)    /* Flushed when less than a line left */
+#define BENCH_LINES     100000
+#define IDLE_MS         1000            /* Wait for inotify at most */
+#define POLL_MS         100             /* Poll interval without inotify */
+#define WATCH_EVENTS    (IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_CLOSE_WRITE)
+#define DIR_EVENTS      (IN_CREATE | IN_MOVED_TO)
+#define CARRY_SZ        BUF_SZ          /* Longest partial line held back */
+#define NR_EVENTS       64
+#define BENCH_STAMPS    1000000
+
+/* Timestamp formats, -t */
+#define TS_CTIME        0               /* [Sat Oct 17 17:35:11 2026] */
+#define TS_ISO          1               /* [2026-10-17T17:35:11.123456+0800] */
+#define TS_EPOCH        2               /* [1760693711123456789], ns */
+#define TS_MONO         3               /* [12.345678], secs since start */
+#define NR_TS_FMTS      4
+
+static const char *ts_names[] = { "ctime", "iso", "epoch", "mono" };
+
+/*
+ * The part of a stamp down to the second is formatted once a second, for
+ * each stamp only the sub-second digits are written. The clock is read
+ * by clock_gettime(), served by the vDSO without a syscall.
+ */
+struct ts_cache {
+        int fmt;
+        clockid_t clock;
+        int digits;                     /* Sub-second digits */
+        long div;                       /* ns to them */
+        time_t sec;                     /* Of head and tail */
+        char head[64];                  /* "[2026-10-17T17:35:11." */
+        size_t hlen;
+        char tail[16];                  /* "+0800]" */
+        size_t tlen;
+        struct timespec start;          /* Of TS_MONO */
+} tsc;
+
+/*
+ * A followed log. It is known by device and inode, so a rename or a new
+ * file at path is noticed and reopened, and by read offset, so a file
+ * shrunk below it is known truncated even if it has grown again. An
+ * incomplete last line is held in carry until its newline is read, with
+ * the stamp of when it started.
+ */
+struct follow {
+        const char *path;
+        const char *name;               /* Basename of path */
+        const char *tag;                /* Of lines in merged output */
+        int fd;
+        int out;
+        dev_t dev;
+        ino_t ino;
+        off_t off;
+        int regular;
+        int wd;                         /* Watch of the file */
+        int dwd;                        /* Watch of its directory */
+        int ready;                      /* May have input to read */
+        int polled;                     /* Pipe fd in epoll */
+        int bol;                        /* Next byte starts a line */
+        char ts[TS_MAX];                /* Stamp of carry */
+        size_t tslen;
+        char carry[CARRY_SZ];
+        size_t clen;
+};
+
+/*
+ * All logs are followed by one thread. A log is ready when an event says
+ * it changed, and every ready log gets one read per round, so a busy log
+ * can not starve the others. Regular files are woken by inotify, pipes
+ * by epoll on their fd.
+ */
+struct follow *follows;
+int nr_follows;
+int ifd = -1;                           /* inotify, -1 to poll */
+int efd;                                /* epoll */
 
 static long get_filesz(int fd)
 {
@@ -25,71 +112,706 @@ static long get_filesz(int fd)
         return stat.st_size;
 }
 
-int main(int argc, char **argv)
+static double now_sec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * writev_full -- writev() all of iov, which is consumed.
+ */
+static int writev_full(int fd, struct iovec *iov, int cnt)
 {
-        int fd = 0, out = 0;
-        char buf[1024];
-        long sz = 0, newsz = 0;
-        struct timespec tm = {0, 1};
         ssize_t ret;
 
-        if (argc != 3) {
-                fprintf(stderr, "Usage %s input output\n", argv[0]);
-                return -1;
+        while (cnt) {
+                ret = writev(fd, iov, cnt);
+                if (ret < 0 && errno == EINTR)
+                        continue;
+                if (ret < 0)
+                        return -1;
+                while (cnt && (size_t)ret >= iov->iov_len) {
+                        ret -= iov->iov_len;
+                        iov++;
+                        cnt--;
+                }
+                if (cnt) {
+                        iov->iov_base = (char *)iov->iov_base + ret;
+                        iov->iov_len -= ret;
+                }
         }
+        return 0;
+}
+
+static int write_full(int fd, const char *buf, size_t len)
+{
+        struct iovec iov = { (void *)buf, len };
+
+        return writev_full(fd, &iov, 1);
+}
+
+/*
+ * ts_setup -- use timestamp format fmt, by name.
+ */
+static int ts_setup(const char *fmt)
+{
+        static const int digits[] = { 0, 6, 9, 6 };
+        int i;
 
-        fd = open(argv[1], O_RDONLY|O_NONBLOCK);
-        if (fd < 0) {
-                perror("open: ");
-                fprintf(stderr, "Usage %s filename\n", argv[0]);
+        for (i = 0; i < NR_TS_FMTS; i++)
+                if (!strcmp(fmt, ts_names[i]))
+                        break;
+        if (i == NR_TS_FMTS)
                 return -1;
+
+        tsc.fmt = i;
+        tsc.clock = i == TS_MONO ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+        tsc.digits = digits[i];
+        for (tsc.div = 1, i = 9; i > tsc.digits; i--)
+                tsc.div *= 10;
+        tsc.sec = -1;
+        clock_gettime(CLOCK_MONOTONIC, &tsc.start);
+        return 0;
+}
+
+/*
+ * ts_refresh -- format head and tail of stamps in second sec.
+ */
+static void ts_refresh(time_t sec)
+{
+        struct tm tm;
+
+        tsc.sec = sec;
+        strcpy(tsc.tail, "]");
+        tsc.tlen = 1;
+
+        switch (tsc.fmt) {
+        case TS_CTIME:
+                tsc.head[0] = '[';
+                ctime_r(&sec, tsc.head + 1);
+                /* Drop '\n' of ctime */
+                tsc.hlen = strlen(tsc.head) - 1;
+                break;
+        case TS_ISO:
+                localtime_r(&sec, &tm);
+                tsc.hlen = strftime(tsc.head, sizeof(tsc.head),
+                                    "[%Y-%m-%dT%H:%M:%S.", &tm);
+                tsc.tlen = strftime(tsc.tail, sizeof(tsc.tail), "%z]", &tm);
+                break;
+        case TS_EPOCH:
+                tsc.hlen = snprintf(tsc.head, sizeof(tsc.head), "[%ld", (long)sec);
+                break;
+        case TS_MONO:
+                tsc.hlen = snprintf(tsc.head, sizeof(tsc.head), "[%ld.", (long)sec);
+                break;
         }
+}
 
-        out = open(argv[2], O_RDWR|O_APPEND|O_CREAT, 0660);
-        if (out < 0) {
-                perror("open: ");
-                return -1;
+static void ts_now(struct timespec *now)
+{
+        clock_gettime(tsc.clock, now);
+        if (tsc.fmt == TS_MONO) {
+                now->tv_sec -= tsc.start.tv_sec;
+                now->tv_nsec -= tsc.start.tv_nsec;
+                if (now->tv_nsec < 0) {
+                        now->tv_nsec += 1000000000;
+                        now->tv_sec--;
+                }
         }
+}
 
-        sz = get_filesz(fd);
-        while(1) {
-                memset(buf, 0, sizeof(buf));
-                ret = read(fd, buf, sizeof(buf));
-
-                if (ret > 0) {
-                        int i;
-                        for (i = 0; i < strlen(buf); i++) {
-                                if (buf[i] != '\n') {
-                                        write(out, &buf[i], 1);
-                                        continue;
-                                } else {
-                                        time_t now = time(NULL);
-                                        char *time_str = ctime(&now);
-                                        time_str[strlen(time_str)-1] = 0;
-                                        write(out, "\n[", 1);
-                                        write(out, time_str, strlen(time_str));
-                                        write(out, "]: ", 3);
-                                }
+static void ts_frac(char *p, long nsec)
+{
+        long frac = nsec / tsc.div;
+        int i;
+
+        for (i = tsc.digits - 1; i >= 0; i--, frac /= 10)
+                p[i] = '0' + frac % 10;
+}
+
+/*
+ * stamp -- format "[time]: ", or "[time] tag: ", of now to buf, return
+ *          its length.
+ */
+static size_t stamp(char *buf, const char *tag)
+{
+        struct timespec now;
+        char *p = buf;
+        size_t n;
+
+        ts_now(&now);
+        if (now.tv_sec != tsc.sec)
+                ts_refresh(now.tv_sec);
+
+        memcpy(p, tsc.head, tsc.hlen);
+        p += tsc.hlen;
+        ts_frac(p, now.tv_nsec);
+        p += tsc.digits;
+        memcpy(p, tsc.tail, tsc.tlen);
+        p += tsc.tlen;
+
+        if (tag) {
+                n = strnlen(tag, TS_MAX - (p - buf) - 3);
+                *p++ = ' ';
+                memcpy(p, tag, n);
+                p += n;
+        }
+        *p++ = ':';
+        *p++ = ' ';
+        return p - buf;
+}
+
+/*
+ * restamp -- bring buf, of len made by stamp() in the cached second, to
+ *            now. Within that second only the sub-second digits are
+ *            rewritten.
+ */
+static size_t restamp(char *buf, size_t len, const char *tag)
+{
+        struct timespec now;
+
+        ts_now(&now);
+        if (now.tv_sec != tsc.sec)
+                return stamp(buf, tag);
+        ts_frac(buf + tsc.hlen, now.tv_nsec);
+        return len;
+}
+
+/*
+ * copy_lines -- copy len bytes of the log to f->out with a timestamp at
+ *               the start of each line. Lines are found with memchr() and
+ *               gathered in one buffer, so a read costs one writev() rather
+ *               than one write() per byte. An incomplete last line goes to
+ *               carry, unless too long, then it is written and the rest of
+ *               it comes without a stamp.
+ */
+static int copy_lines(struct follow *f, const char *buf, size_t len)
+{
+        static char obuf[OBUF_SZ];
+        const char *p = buf, *end = buf + len, *nl, *pre;
+        char ts[TS_MAX];
+        size_t n, olen = 0, tslen = 0, prelen;
+
+        while (p < end) {
+                nl = memchr(p, '\n', end - p);
+                n = nl ? nl + 1 - p : end - p;
+
+                /* Each line gets its own time, the cached prefix is reused */
+                if (f->bol && !f->clen)
+                        tslen = tslen ? restamp(ts, tslen, f->tag) :
+                                        stamp(ts, f->tag);
+
+                if (!nl && f->clen + n <= CARRY_SZ) {
+                        if (f->bol && !f->clen) {
+                                memcpy(f->ts, ts, tslen);
+                                f->tslen = tslen;
                         }
+                        memcpy(f->carry + f->clen, p, n);
+                        f->clen += n;
+                        break;
+                }
+
+                pre = f->clen ? f->ts : ts;
+                prelen = !f->bol ? 0 : f->clen ? f->tslen : tslen;
+                if (olen + prelen + f->clen + n > OBUF_SZ) {
+                        struct iovec iov[4] = {
+                                { obuf, olen }, { (void *)pre, prelen },
+                                { f->carry, f->clen }, { (void *)p, n }
+                        };
+
+                        if (writev_full(f->out, iov, 4))
+                                return -1;
+                        olen = 0;
                 } else {
-                        nanosleep(&tm, NULL);
+                        memcpy(obuf + olen, pre, prelen);
+                        olen += prelen;
+                        memcpy(obuf + olen, f->carry, f->clen);
+                        olen += f->clen;
+                        memcpy(obuf + olen, p, n);
+                        olen += n;
                 }
+                f->clen = 0;
+                f->bol = nl != NULL;
+                p += n;
+        }
+
+        return olen ? write_full(f->out, obuf, olen) : 0;
+}
+
+/*
+ * copy_flush -- end the line in progress, the file it came from is gone.
+ */
+static int copy_flush(struct follow *f)
+{
+        if (f->clen || !f->bol)
+                return copy_lines(f, "\n", 1);
+        return 0;
+}
 
-                newsz = get_filesz(fd);
-                if (!newsz && sz) {
+/*
+ * copy_bytes -- the old copy path, one write() per byte and three per
+ *               newline. Only kept to compare with in bench(), so it is
+ *               left as it was, '[' it drops included.
+ */
+static void copy_bytes(int out, char *buf)
+{
+        int i;
+
+        for (i = 0; i < strlen(buf); i++) {
+                if (buf[i] != '\n') {
+                        write(out, &buf[i], 1);
+                        continue;
+                } else {
                         time_t now = time(NULL);
                         char *time_str = ctime(&now);
                         time_str[strlen(time_str)-1] = 0;
-
-                        write(out, "[", 1);
+                        write(out, "\n[", 1);
                         write(out, time_str, strlen(time_str));
-                        write(out, "] ********** \n", 14);
-                        lseek(fd, 0, SEEK_SET);
+                        write(out, "]: ", 3);
+                }
+        }
+}
+
+/*
+ * bench_run -- pull the whole input as the main loop does, with the old
+ *              or the new copy path, return seconds taken.
+ */
+static double bench_run(int in, int out, int old)
+{
+        static char buf[BUF_SZ];
+        char obuf[1024];
+        ssize_t ret;
+        struct follow f = { .out = out, .bol = 1 };
+        double t;
+
+        lseek(in, 0, SEEK_SET);
+        lseek(out, 0, SEEK_SET);
+        if (ftruncate(out, 0) < 0)
+                return -1;
+
+        t = now_sec();
+        if (old) {
+                memset(obuf, 0, sizeof(obuf));
+                while ((ret = read(in, obuf, sizeof(obuf) - 1)) > 0) {
+                        copy_bytes(out, obuf);
+                        memset(obuf, 0, sizeof(obuf));
+                }
+        } else {
+                while ((ret = read(in, buf, sizeof(buf))) > 0)
+                        if (copy_lines(&f, buf, ret))
+                                return -1;
+        }
+        return now_sec() - t;
+}
+
+/*
+ * bench_stamps -- ns per stamp of the old time()+ctime() and of each
+ *                 format.
+ */
+static void bench_stamps(void)
+{
+        char buf[TS_MAX];
+        size_t len = 0;
+        time_t now;
+        double t;
+        long i;
+        int m;
+
+        t = now_sec();
+        for (i = 0; i < BENCH_STAMPS; i++) {
+                now = time(NULL);
+                snprintf(buf, TS_MAX, "[%s", ctime(&now));
+                buf[strlen(buf) - 1] = 0;
+        }
+        t = now_sec() - t;
+        fprintf(stdout, "stamps:\n  %-8s: %6.1f ns\n", "old",
+                t * 1e9 / BENCH_STAMPS);
+
+        for (m = 0; m < NR_TS_FMTS; m++) {
+                ts_setup(ts_names[m]);
+                t = now_sec();
+                for (i = 0; i < BENCH_STAMPS; i++)
+                        len = stamp(buf, NULL);
+                t = now_sec() - t;
+                buf[len] = 0;
+                fprintf(stdout, "  %-8s: %6.1f ns  %s\n", ts_names[m],
+                        t * 1e9 / BENCH_STAMPS, buf);
+        }
+}
+
+/*
+ * bench -- throughput of the copy paths on a synthetic log of nr lines,
+ *          as a fast growing log looks to the main loop. Best of 3 runs.
+ */
+static int bench(long nr)
+{
+        char in_file[] = "/tmp/logfile_timestamp.in.XXXXXX";
+        char out_file[] = "/tmp/logfile_timestamp.out.XXXXXX";
+        static const char *names[] = { "bytewise", "lines" };
+        double t, elapsed[2];
+        long i, size = 0;
+        int in, out, m, r;
+        FILE *fp;
+
+        in = mkstemp(in_file);
+        out = mkstemp(out_file);
+        if (in < 0 || out < 0) {
+                perror("mkstemp: ");
+                return -1;
+        }
+        unlink(in_file);
+        unlink(out_file);
+
+        fp = fdopen(dup(in), "w");
+        for (i = 0; fp && i < nr; i++)
+                size += fprintf(fp, "kernel: [%10ld.%06ld] eth0: link up, "
+                                "%ld Mbps, rx %ld tx %ld\n", i / 1000,
+                                i % 1000 * 1000, i % 4 * 25000, i * 7, i * 3);
+        if (fp == NULL || fclose(fp)) {
+                fprintf(stderr, "Failed to generate the log\n");
+                return -1;
+        }
+
+        for (m = 0; m < 2; m++) {
+                elapsed[m] = 1e30;
+                for (r = 0; r < 3; r++) {
+                        t = bench_run(in, out, !m);
+                        if (t < 0) {
+                                fprintf(stderr, "Failed to write the output\n");
+                                return -1;
+                        }
+                        if (t < elapsed[m])
+                                elapsed[m] = t;
                 }
-                sz = newsz;
         }
 
-        close(fd);
+        fprintf(stdout, "%ld lines, %ld bytes\n", nr, size);
+        for (m = 0; m < 2; m++)
+                fprintf(stdout, "  %-8s: %10.0f lines/s %8.1f MB/s (%.1fx)\n",
+                        names[m], nr / elapsed[m], size / elapsed[m] / 1048576,
+                        elapsed[0] / elapsed[m]);
+
+        close(in);
         close(out);
+
+        bench_stamps();
+        return 0;
+}
+
+/*
+ * follow_open -- open f->path from its start and watch it.
+ */
+static int follow_open(struct follow *f)
+{
+        struct stat st;
+        int fd;
+
+        fd = open(f->path, O_RDONLY|O_NONBLOCK);
+        if (fd < 0)
+                return -1;
+        if (fstat(fd, &st) < 0) {
+                close(fd);
+                return -1;
+        }
+        if (f->fd >= 0) {
+                if (f->polled)
+                        epoll_ctl(efd, EPOLL_CTL_DEL, f->fd, NULL);
+                close(f->fd);
+        }
+        f->fd = fd;
+        f->dev = st.st_dev;
+        f->ino = st.st_ino;
+        f->off = 0;
+        f->regular = S_ISREG(st.st_mode);
+
+        f->ready = 1;
+
+        if (ifd >= 0) {
+                if (f->wd >= 0)
+                        inotify_rm_watch(ifd, f->wd);
+                f->wd = inotify_add_watch(ifd, f->path, WATCH_EVENTS);
+        }
+        f->polled = 0;
+        if (!f->regular) {
+                struct epoll_event ev = { .events = EPOLLIN, .data.ptr = f };
+
+                f->polled = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == 0;
+        }
+        return 0;
+}
+
+/*
+ * follow_mark -- note in the output that the input starts over.
+ */
+static void follow_mark(struct follow *f, const char *why)
+{
+        char ts[TS_MAX];
+        size_t len;
+
+        copy_flush(f);
+        len = stamp(ts, f->tag);
+        /* "[time]: " => "[time] " */
+        ts[len - 2] = ' ';
+        ts[len - 1] = 0;
+        dprintf(f->out, "%s********** %s\n", ts, why);
+}
+
+/*
+ * follow_check -- at the end of input, see if the file was truncated, or
+ *                 path moved to another file. Return 1 if there is input
+ *                 to read again.
+ */
+static int follow_check(struct follow *f)
+{
+        struct stat st;
+
+        if (!f->regular)
+                return 0;
+
+        if (get_filesz(f->fd) < f->off) {
+                follow_mark(f, "truncated");
+                lseek(f->fd, 0, SEEK_SET);
+                f->off = 0;
+                return 1;
+        }
+
+        /* Removed or renamed, wait for a new one, the old is drained */
+        if (stat(f->path, &st) < 0)
+                return 0;
+        if (st.st_dev == f->dev && st.st_ino == f->ino)
+                return 0;
+        if (follow_open(f) < 0)
+                return 0;
+        follow_mark(f, "rotated");
+        return 1;
+}
+
+/*
+ * follow_add -- follow path to out, lines tagged with tag if not NULL.
+ */
+static int follow_add(const char *path, int out, const char *tag)
+{
+        struct follow *f = &follows[nr_follows];
+        char dir[PATH_MAX], *slash;
+
+        memset(f, 0, sizeof(*f));
+        f->path = path;
+        f->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        f->tag = tag;
+        f->out = out;
+        f->fd = f->wd = f->dwd = -1;
+        f->bol = 1;
+        if (follow_open(f) < 0) {
+                fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        /* A new file at path shows up in its directory */
+        snprintf(dir, PATH_MAX, "%s", path);
+        slash = strrchr(dir, '/');
+        if (slash)
+                slash[1] = 0;
+        if (ifd >= 0 && (f->wd < 0 || (f->dwd = inotify_add_watch(ifd,
+                                slash ? dir : ".", DIR_EVENTS)) < 0)) {
+                fprintf(stderr, "No inotify on %s, poll every %dms\n",
+                        path, POLL_MS);
+                close(ifd);
+                ifd = -1;
+        }
+        nr_follows++;
+        return 0;
+}
+
+/*
+ * follow_read -- one read of a ready log. Return 1 if it may have more.
+ */
+static int follow_read(struct follow *f, char *buf)
+{
+        ssize_t ret;
+
+        ret = read(f->fd, buf, BUF_SZ);
+        if (ret > 0) {
+                f->off += ret;
+                if (copy_lines(f, buf, ret))
+                        perror("write: ");
+                return 1;
+        }
+        if (ret < 0 && errno != EAGAIN && errno != EINTR)
+                perror("read: ");
+
+        if (follow_check(f))
+                return 1;
+        f->ready = 0;
+        return 0;
+}
+
+/*
+ * inotify_ready -- mark the logs named by pending inotify events ready.
+ */
+static void inotify_ready(void)
+{
+        char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *e;
+        ssize_t len;
+        char *p;
+        int i;
+
+        while ((len = read(ifd, ev, sizeof(ev))) > 0) {
+                for (p = ev; p < ev + len; p += sizeof(*e) + e->len) {
+                        e = (const struct inotify_event *)p;
+                        for (i = 0; i < nr_follows; i++) {
+                                struct follow *f = &follows[i];
+
+                                if (e->mask & IN_Q_OVERFLOW || e->wd == f->wd ||
+                                    (e->wd == f->dwd && e->len &&
+                                     !strcmp(e->name, f->name)))
+                                        f->ready = 1;
+                        }
+                }
+        }
+}
+
+/*
+ * wait_events -- mark logs with events ready, sleep for them if idle.
+ *                The sleep is bounded by IDLE_MS, in case a change makes
+ *                no event, such as a write from another NFS client, or
+ *                POLL_MS without inotify, then every log is checked.
+ */
+static void wait_events(int idle)
+{
+        struct epoll_event evs[NR_EVENTS];
+        struct follow *f;
+        int i, n;
+
+        n = epoll_wait(efd, evs, NR_EVENTS,
+                       !idle ? 0 : ifd >= 0 ? IDLE_MS : POLL_MS);
+        if (n == 0 && idle)
+                for (i = 0; i < nr_follows; i++)
+                        follows[i].ready = 1;
+
+        for (i = 0; i < n; i++) {
+                f = evs[i].data.ptr;
+                if (f == NULL) {
+                        inotify_ready();
+                        continue;
+                }
+                f->ready = 1;
+                /*
+                 * Writer of the pipe is gone. A new read end is not hung
+                 * up until a writer comes and goes again, so reopen it to
+                 * wait for the next one. Failing that, leave it to the
+                 * timeout.
+                 */
+                if ((evs[i].events & (EPOLLHUP|EPOLLIN)) == EPOLLHUP &&
+                    follow_open(f) < 0) {
+                        epoll_ctl(efd, EPOLL_CTL_DEL, f->fd, NULL);
+                        f->polled = 0;
+                }
+        }
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "Usage %s [-t fmt] input output [input output]...\n", prog);
+        fprintf(stderr, "      %s [-t fmt] -m output input...\n", prog);
+        fprintf(stderr, "      %s -b [lines]\n", prog);
+        fprintf(stderr, "    -b     : Benchmark on a synthetic log\n");
+        fprintf(stderr, "    -m     : Merge inputs to output, tagged by name\n");
+        fprintf(stderr, "    -t fmt : Timestamp format. Default: ctime\n");
+        fprintf(stderr, "             ctime: Sat Oct 17 17:35:11 2026\n");
+        fprintf(stderr, "             iso:   2026-10-17T17:35:11.123456+0800\n");
+        fprintf(stderr, "             epoch: nanoseconds since the epoch\n");
+        fprintf(stderr, "             mono:  seconds since start, in microseconds\n");
+}
+
+int main(int argc, char **argv)
+{
+        static char buf[BUF_SZ];
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        int i, out, busy, opt, merge = 0, bench_mode = 0;
+        const char *prog = argv[0];
+
+        ts_setup("ctime");
+        while ((opt = getopt(argc, argv, "bmt:h")) != -1) {
+                switch (opt) {
+                case 'b':
+                        bench_mode = 1;
+                        break;
+                case 'm':
+                        merge = 1;
+                        break;
+                case 't':
+                        if (ts_setup(optarg) == 0)
+                                break;
+                        fprintf(stderr, "Invalid timestamp format %s\n", optarg);
+                        /* fallthrough */
+                default:
+                        usage(prog);
+                        return -1;
+                }
+        }
+        /* argv[1] on is the positional arguments */
+        argv += optind - 1;
+        argc -= optind - 1;
+
+        if (bench_mode)
+                return bench(argc > 1 ? atol(argv[1]) : BENCH_LINES);
+
+        if (merge ? argc < 3 : argc < 3 || argc % 2 == 0) {
+                usage(prog);
+                return -1;
+        }
+
+        efd = epoll_create1(EPOLL_CLOEXEC);
+        if (efd < 0) {
+                perror("epoll: ");
+                return -1;
+        }
+        ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ifd >= 0 && epoll_ctl(efd, EPOLL_CTL_ADD, ifd, &ev) < 0) {
+                close(ifd);
+                ifd = -1;
+        }
+
+        follows = calloc(argc, sizeof(*follows));
+        if (follows == NULL) {
+                perror("calloc: ");
+                return -1;
+        }
+
+        if (merge) {
+                out = open(argv[1], O_RDWR|O_APPEND|O_CREAT, 0660);
+                if (out < 0) {
+                        perror("open: ");
+                        return -1;
+                }
+                for (i = 2; i < argc; i++)
+                        if (follow_add(argv[i], out, strrchr(argv[i], '/') ?
+                                       strrchr(argv[i], '/') + 1 : argv[i]))
+                                return -1;
+        } else {
+                for (i = 1; i < argc; i += 2) {
+                        out = open(argv[i + 1], O_RDWR|O_APPEND|O_CREAT, 0660);
+                        if (out < 0) {
+                                perror("open: ");
+                                return -1;
+                        }
+                        if (follow_add(argv[i], out, NULL))
+                                return -1;
+                }
+        }
+
+        while(1) {
+                busy = 0;
+                for (i = 0; i < nr_follows; i++)
+                        if (follows[i].ready && follow_read(&follows[i], buf))
+                                busy = 1;
+                /* Logs changed meanwhile join the next round */
+                wait_events(!busy);
+        }
+
         return 0;
 }
@@ -1,7 +1,7 @@
 /*
  * mpstat2numa.c -- covert mpstat workload to numa node view
  *
- * Compile:  gcc -Wall -o mpstat2numa mpstat2numa.c
+ * Compile:  gcc -Wall -pthread -o mpstat2numa mpstat2numa.c -lz
  *
  * By: Joe Jin <joe.jin@oracle.com>
  *
@@ -13,244 +13,2859 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+/*
+ * CPU Topology:
+ *
+ * The cpu -> node mapping is discovered at runtime, either from sysfs
+ * (/sys/devices/system/node/node*\/cpulist) or from a lscpu output which
+ * is captured alongside the mpstat logs (-topo file), e.g.:
+ *
+ * NUMA node0 CPU(s):     0-27,224-251
+ * NUMA node1 CPU(s):     28-55,252-279
+ * ...
+ */
+#define SYSFS_NODE_PATH "/sys/devices/system/node"
+#define LSCPU_NODE_FMT  "NUMA node%d CPU(s):"
+
+#ifndef PATH_MAX
+#define PATH_MAX        80
+#endif
+
+#define NR_HLINES       20      /* print header after print data lines */
+
+#define MAX_VALS        10      /* %usr ... %gnice %idle */
+
+#define CHUNK_SIZE      (64UL << 20)    /* Bytes of mmaped file per worker */
+#define READ_SIZE       (1UL << 20)     /* Bytes per read() of stream */
+#define PIPE_SIZE       (1UL << 20)     /* Pipe buffer of decompressor */
+#define MAGIC_LEN       6
+
+#define PROC_STAT       "/proc/stat"
+
+#define BIN_MAGIC       "M2NCOL1"       /* Binary columnar output */
+#define BIN_BLOCK_MAGIC 0x4b4c4232      /* "2BLK" */
+#define BIN_TIME_LEN    16      /* Bytes of time column per row */
+#define BIN_BLOCK_ROWS  4096    /* Rows per block */
+#define BIN_BUF_SIZE    (4UL << 20)
+
+#define HIST_BUCKETS    10001   /* 0.00% ... 100.00% in hundredths */
+
+#define IDX_MAGIC       "M2NIDX1"       /* Sidecar index of input */
+#define IDX_SUFFIX      ".m2nidx"
+
+char *prog;
+
+int usr_flag = 0;               /* print %usr only */
+int nice_flag = 0;              /* print %nice only */
+int sys_flag = 0;               /* print %sys only */
+int iowait_flag = 0;            /* print %iowait only */
+int irq_flag = 0;               /* print %irq only */
+int soft_flag = 0;              /* print %soft only */
+int steal_flag = 0;             /* print %steal only */
+int guest_flag = 0;             /* print %guest only */
+int gnice_flag = 0;             /* print %gnice only */
+int idle_flag = 0;              /* print %idle only */
+int util_flag = 0;              /* print 100 - idle */
+int print_all = 1;              /* print all nodes stat */
+int header_flag = 1;            /* print header or no? */
+int nowarn_flag = 0;            /* print warn on error? */
+int print_fields = 0;           /* number fields to be printed */
+int node = -1;                  /* The node to print the stat */
+int cpu = -1;                   /* CPU list to print stat */
+int bench_flag = 0;             /* benchmark line parser */
+int dump_flag = 0;              /* inputs are binary output, print text */
+char *bin_file = NULL;          /* write binary columnar output to */
+FILE *bin_fp = NULL;
+int nr_jobs = 1;                /* Number of worker threads */
+double live_interval = 0;       /* Seconds between /proc/stat samples */
+long live_count = 0;            /* Number of samples, 0 for endless */
+char *topo_file = NULL;         /* lscpu output to read topology from */
+int summary_flag = 0;           /* print percentiles per input instead */
+int window_flag = 0;            /* -from or -to given */
+int from_sec = 0;               /* Window of time of day, in seconds */
+int to_sec = 86399;
+int resample = 1;               /* Average every N intervals into one */
+int index_flag = 0;             /* Use/build sidecar index of input */
+
+int max_files = 0;
+
+/*
+ * All values are kept in hundredths of percent, mpstat prints them with
+ * "%.2f" so they are parsed to integer without any precision lost.
+ */
+struct numa_stat {
+        char time[32];
+        long usr;
+        long nice;
+        long sys;
+        long iowait;
+        long irq;
+        long soft;
+        long steal;
+        long guest;
+        long gnice;
+        long idle;
+};
+
+/* Columns of struct numa_stat, in the order of mpstat */
+static const struct field {
+        const char *name;
+        size_t off;
+} fields[] = {
+        { "usr",        offsetof(struct numa_stat, usr) },
+        { "nice",       offsetof(struct numa_stat, nice) },
+        { "sys",        offsetof(struct numa_stat, sys) },
+        { "iowait",     offsetof(struct numa_stat, iowait) },
+        { "irq",        offsetof(struct numa_stat, irq) },
+        { "soft",       offsetof(struct numa_stat, soft) },
+        { "steal",      offsetof(struct numa_stat, steal) },
+        { "guest",      offsetof(struct numa_stat, guest) },
+        { "gnice",      offsetof(struct numa_stat, gnice) },
+        { "idle",       offsetof(struct numa_stat, idle) },
+};
+
+#define NR_FIELDS       (sizeof(fields) / sizeof(fields[0]))
+#define FIELD(s, f)     (*(long *)((char *)(s) + fields[(f)].off))
+#define FIELD_GNICE     8
+#define FIELD_IDLE      9
+
+struct topology {
+        int nr_cpus;            /* Size of cpu2node[], max cpu id + 1 */
+        int nr_nodes;           /* Size of node_cpus[], max node id + 1 */
+        int *cpu2node;          /* cpu -> node, -1 if cpu is not mapped */
+        int *node_cpus;         /* Number of CPUs of node */
+        int *cpu2slot;          /* cpu -> slot of struct soa, -1 if unmapped */
+        int *node_off;          /* First slot of node, nr_nodes + 1 entries */
+        int nr_slots;           /* Number of mapped CPUs */
+};
+
+struct topology topo;
+
+/*
+ * Structure of arrays of one interval: the values of all CPUs per field,
+ * CPUs of a node are in contiguous slots so a node is reduced by a
+ * vector sum of [node_off[n], node_off[n + 1]) of each column.
+ */
+struct soa {
+        int32_t *col[NR_FIELDS];
+        char time[32];
+        int has_time;           /* Got any CPU line of the interval */
+};
+
+/*
+ * Per input file state, files are processed by a pool of workers and the
+ * output of each file is buffered to be printed in command line order.
+ */
+struct m2n_ctx {
+        const char *fn;
+        FILE *out;              /* stdout or memstream of buf */
+        char *buf;
+        size_t buf_len;
+        struct numa_stat *stats;/* Per node stat, topo.nr_nodes entries */
+        int gnice;              /* Has gnice? */
+        int first;              /* Got first header? */
+        int print_lines;        /* Printed lines, to repeat header */
+        int nr_jobs;            /* Chunk workers of this file */
+        int stop;               /* Stop processing and exit */
+        int ret;
+        struct bin_block *bin;  /* Pending rows of binary output */
+        struct soa soa;         /* CPUs of current interval */
+        struct summary *sum;    /* Histograms of -summary */
+        struct numa_stat *rs;   /* Pending sums of -resample */
+        int rs_n;               /* Intervals in rs */
+};
+
+/*
+ * Binary columnar output, in host byte order:
+ *
+ *   struct bin_header, node_cpus[nr_nodes] (uint32), field names
+ *   (char[8] * nr_fields), then blocks of:
+ *
+ *   struct bin_block_header, time (char[BIN_TIME_LEN] * nr_rows),
+ *   node (uint16 * nr_rows), then one int64 column per field of sums in
+ *   hundredths of percent.
+ *
+ * One row per node per interval, nodes of an interval are in order.
+ */
+struct bin_header {
+        char magic[8];
+        uint32_t nr_nodes;
+        uint32_t nr_fields;
+        uint32_t time_len;
+        uint32_t reserved;
+};
+
+#define BLK_FIRST       0x1     /* First block of an input file */
+#define BLK_GNICE       0x2     /* mpstat output includes %gnice */
+
+struct bin_block_header {
+        uint32_t magic;
+        uint32_t nr_rows;
+        uint32_t flags;
+        uint32_t reserved;
+};
+
+struct bin_block {
+        int nr_rows;
+        int flags;
+        char (*time)[BIN_TIME_LEN];
+        uint16_t *node;
+        int64_t *col[NR_FIELDS];
+};
+
+/* Divisor of node, nodes without CPU (memory only) are kept as 1 */
+#define NODE_CPUS(n) (topo.node_cpus[(n)] ? topo.node_cpus[(n)] : 1)
+
+/* Average percent of the member on node */
+#define NODE_PCT(s, n, member) \
+        ((double)(s)[(n)].member / (NODE_CPUS(n) * 100))
+
+/*
+ * topo_grow -- make sure cpu2node[] covers @nr_cpus and node_cpus[] covers
+ *              @nr_nodes entries.
+ */
+static int topo_grow(int nr_cpus, int nr_nodes)
+{
+        int *p, i;
+
+        if (nr_cpus > topo.nr_cpus) {
+                p = realloc(topo.cpu2node, nr_cpus * sizeof(int));
+                if (p == NULL)
+                        return -1;
+                for (i = topo.nr_cpus; i < nr_cpus; i++)
+                        p[i] = -1;
+                topo.cpu2node = p;
+                topo.nr_cpus = nr_cpus;
+        }
+
+        if (nr_nodes > topo.nr_nodes) {
+                p = realloc(topo.node_cpus, nr_nodes * sizeof(int));
+                if (p == NULL)
+                        return -1;
+                for (i = topo.nr_nodes; i < nr_nodes; i++)
+                        p[i] = 0;
+                topo.node_cpus = p;
+                topo.nr_nodes = nr_nodes;
+        }
+        return 0;
+}
+
+/*
+ * topo_add_cpulist -- add cpus of kernel cpulist format ("0-27,224-251")
+ *                     to the node.
+ *
+ * Return 0 if success, otherwise -1.
+ */
+static int topo_add_cpulist(int nid, const char *list)
+{
+        const char *p = list;
+        char *end;
+        long first, last, c;
+
+        if (nid < 0 || topo_grow(0, nid + 1))
+                return -1;
+
+        while (*p) {
+                while (isspace(*p) || *p == ',')
+                        p++;
+                if (*p == '\0')
+                        break;
+                first = strtol(p, &end, 10);
+                if (end == p || first < 0)
+                        return -1;
+                last = first;
+                p = end;
+                if (*p == '-') {
+                        p++;
+                        last = strtol(p, &end, 10);
+                        if (end == p || last < first)
+                                return -1;
+                        p = end;
+                }
+                if (topo_grow(last + 1, 0))
+                        return -1;
+                for (c = first; c <= last; c++) {
+                        if (topo.cpu2node[c] >= 0)
+                                topo.node_cpus[topo.cpu2node[c]]--;
+                        topo.cpu2node[c] = nid;
+                        topo.node_cpus[nid]++;
+                }
+        }
+        return 0;
+}
+
+/*
+ * topo_load_sysfs -- read topology from /sys/devices/system/node
+ */
+static int topo_load_sysfs(void)
+{
+        DIR *dir;
+        struct dirent *de;
+        char path[PATH_MAX], buf[4096];
+        FILE *fp;
+        int nid, ret = 0;
+
+        dir = opendir(SYSFS_NODE_PATH);
+        if (dir == NULL)
+                return -1;
+
+        while ((de = readdir(dir)) != NULL) {
+                if (sscanf(de->d_name, "node%d", &nid) != 1)
+                        continue;
+                snprintf(path, sizeof(path), SYSFS_NODE_PATH "/%s/cpulist",
+                         de->d_name);
+                fp = fopen(path, "r");
+                if (fp == NULL)
+                        continue;
+                if (fgets(buf, sizeof(buf), fp) == NULL)
+                        buf[0] = '\0';
+                fclose(fp);
+                if (topo_add_cpulist(nid, buf)) {
+                        ret = -1;
+                        break;
+                }
+        }
+        closedir(dir);
+        return ret;
+}
+
+/*
+ * topo_load_file -- read topology from lscpu output
+ */
+static int topo_load_file(const char *fn)
+{
+        FILE *fp;
+        char *line = NULL, *p;
+        size_t len = 0;
+        int nid, ret = 0;
+
+        fp = fopen(fn, "r");
+        if (fp == NULL)
+                return -1;
+
+        while (getline(&line, &len, fp) != -1) {
+                p = line;
+                while (isspace(*p))
+                        p++;
+                if (sscanf(p, LSCPU_NODE_FMT, &nid) != 1)
+                        continue;
+                p = strchr(p, ':');
+                if (p == NULL || topo_add_cpulist(nid, p + 1)) {
+                        ret = -1;
+                        break;
+                }
+        }
+        free(line);
+        fclose(fp);
+        return ret;
+}
+
+/*
+ * topo_build_slots -- number the mapped CPUs node by node
+ */
+static int topo_build_slots(void)
+{
+        int c, n, *next;
+
+        free(topo.cpu2slot);
+        free(topo.node_off);
+        topo.cpu2slot = malloc(topo.nr_cpus * sizeof(int));
+        topo.node_off = calloc(topo.nr_nodes + 1, sizeof(int));
+        next = calloc(topo.nr_nodes, sizeof(int));
+        if (topo.cpu2slot == NULL || topo.node_off == NULL || next == NULL) {
+                free(next);
+                return -1;
+        }
+
+        for (n = 0; n < topo.nr_nodes; n++)
+                topo.node_off[n + 1] = topo.node_off[n] + topo.node_cpus[n];
+        topo.nr_slots = topo.node_off[topo.nr_nodes];
+        for (n = 0; n < topo.nr_nodes; n++)
+                next[n] = topo.node_off[n];
+        for (c = 0; c < topo.nr_cpus; c++) {
+                n = topo.cpu2node[c];
+                topo.cpu2slot[c] = n < 0 ? -1 : next[n]++;
+        }
+        free(next);
+        return 0;
+}
+
+/*
+ * load_topology -- build cpu -> node table and allocate per node stats
+ *
+ * Return 0 if success, otherwise -1.
+ */
+int load_topology(void)
+{
+        int ret;
+
+        if (topo_file)
+                ret = topo_load_file(topo_file);
+        else
+                ret = topo_load_sysfs();
+        if (ret || topo.nr_nodes == 0 || topo.nr_cpus == 0)
+                return -1;
+        return topo_build_slots();
+}
+
+void print_stat_multi(struct m2n_ctx *ctx)
+{
+        int i;
+        struct numa_stat *s = ctx->stats;
+        FILE *out = ctx->out;
+
+#define printf_field(f) fprintf(out, "%8s", f)
+        if (header_flag && ctx->print_lines % NR_HLINES == 0) {
+                fprintf(out, "\n%-13s%4s", "TIME", "NODE");
+                if (print_all || usr_flag)      printf_field("%usr");
+                if (print_all || nice_flag)     printf_field("%nice");
+                if (print_all || sys_flag)      printf_field("%sys");
+                if (print_all || iowait_flag)   printf_field("iowait");
+                if (print_all || irq_flag)      printf_field("%irq");
+                if (print_all || soft_flag)     printf_field("%soft");
+                if (print_all || steal_flag)    printf_field("%steal");
+                if (print_all || guest_flag)    printf_field("%guest");
+                if (ctx->gnice && (print_all || gnice_flag)) printf_field("%gnice");
+                if (print_all || idle_flag)     printf_field("%idle");
+                if (util_flag)                  printf_field("%util");
+                fprintf(out, "\n");
+        }
+
+#define printf_value(member) fprintf(out, "%8.2f", NODE_PCT(s, i, member))
+
+        for (i = 0; i < topo.nr_nodes; i++) {
+                if (node != -1 && i != node) continue;
+                ctx->print_lines++;
+                fprintf(out, "%-13s%4d", s[i].time, i);
+                if (print_all || usr_flag)      printf_value(usr);
+                if (print_all || nice_flag)     printf_value(nice);
+                if (print_all || sys_flag)      printf_value(sys);
+                if (print_all || iowait_flag)   printf_value(iowait);
+                if (print_all || irq_flag)      printf_value(irq);
+                if (print_all || soft_flag)     printf_value(soft);
+                if (print_all || steal_flag)    printf_value(steal);
+                if (print_all || guest_flag)    printf_value(guest);
+                if (ctx->gnice && (print_all || gnice_flag)) printf_value(gnice);
+                if (print_all || idle_flag)     printf_value(idle);
+                if (util_flag)
+                        fprintf(out, "%8.2f",
+                                (100.00 - NODE_PCT(s, i, idle)));
+        }
+        if (header_flag)
+                fprintf(out, "\n");
+        memset(s, 0, topo.nr_nodes * sizeof(*s));
+}
+
+void print_stat_util(struct m2n_ctx *ctx)
+{
+        int i;
+        struct numa_stat *s = ctx->stats;
+        FILE *out = ctx->out;
+
+        ctx->print_lines++;
+        if (header_flag && ctx->print_lines % NR_HLINES == 0) {
+                fprintf(out, "\n%-13s", "UTIL_TIME");
+                for (i = 0; i < topo.nr_nodes; i++)
+                        fprintf(out, "%6s%02d ", "N", i);
+                fprintf(out, "\n");
+        }
+        fprintf(out, "%-12s", s[0].time);
+        for (i = 0; i < topo.nr_nodes; i++)
+                fprintf(out, "%9.2f",
+                        (100.00 - NODE_PCT(s, i, idle)));
+        fprintf(out, "\n");
+        memset(s, 0, topo.nr_nodes * sizeof(*s));
+}
+
+#define define_print_stat(name)                                         \
+  void print_stat_##name(struct m2n_ctx *ctx) {                         \
+        int i;                                                          \
+        struct numa_stat *s = ctx->stats;                               \
+        FILE *out = ctx->out;                                           \
+        ctx->print_lines++;                                             \
+        if (header_flag && ctx->print_lines % NR_HLINES  == 0) {        \
+                fprintf(out, "\n%-13s", #name"-TIME");                  \
+                for (i = 0; i < topo.nr_nodes; i++)                     \
+                        fprintf(out, "%6s%02d ", "N", i);               \
+                fprintf(out, "\n");                                     \
+        }                                                               \
+        fprintf(out, "%-12s", s[0].time);                               \
+        for (i = 0; i < topo.nr_nodes; i++)                             \
+                fprintf(out, "%9.2f", NODE_PCT(s, i, name));            \
+        fprintf(out, "\n");                                             \
+        memset(s, 0, topo.nr_nodes * sizeof(*s));                       \
+}
+
+define_print_stat(usr)
+define_print_stat(nice)
+define_print_stat(sys)
+define_print_stat(iowait)
+define_print_stat(irq)
+define_print_stat(soft)
+define_print_stat(steal)
+define_print_stat(guest)
+define_print_stat(idle)
+define_print_stat(gnice)
+
+/*
+ * bin_flush -- write the pending rows of ctx as one block to ctx->out
+ */
+void bin_flush(struct m2n_ctx *ctx)
+{
+        struct bin_block *b = ctx->bin;
+        struct bin_block_header h;
+        int f;
+
+        if (b == NULL || b->nr_rows == 0)
+                return;
+
+        memset(&h, 0, sizeof(h));
+        h.magic = BIN_BLOCK_MAGIC;
+        h.nr_rows = b->nr_rows;
+        h.flags = b->flags | (ctx->gnice ? BLK_GNICE : 0);
+        fwrite(&h, sizeof(h), 1, ctx->out);
+        fwrite(b->time, BIN_TIME_LEN, b->nr_rows, ctx->out);
+        fwrite(b->node, sizeof(*b->node), b->nr_rows, ctx->out);
+        for (f = 0; f < NR_FIELDS; f++)
+                fwrite(b->col[f], sizeof(int64_t), b->nr_rows, ctx->out);
+        b->nr_rows = 0;
+        b->flags = 0;
+}
+
+void bin_free(struct m2n_ctx *ctx)
+{
+        struct bin_block *b = ctx->bin;
+        int f;
+
+        if (b == NULL)
+                return;
+        free(b->time);
+        free(b->node);
+        for (f = 0; f < NR_FIELDS; f++)
+                free(b->col[f]);
+        free(b);
+        ctx->bin = NULL;
+}
+
+static struct bin_block *bin_alloc(void)
+{
+        struct bin_block *b;
+        int f;
+
+        b = calloc(1, sizeof(*b));
+        if (b == NULL)
+                return NULL;
+        b->flags = BLK_FIRST;
+        b->time = malloc(BIN_BLOCK_ROWS * BIN_TIME_LEN);
+        b->node = malloc(BIN_BLOCK_ROWS * sizeof(*b->node));
+        if (b->time == NULL || b->node == NULL)
+                goto fail;
+        for (f = 0; f < NR_FIELDS; f++) {
+                b->col[f] = malloc(BIN_BLOCK_ROWS * sizeof(int64_t));
+                if (b->col[f] == NULL)
+                        goto fail;
+        }
+        return b;
+
+fail:
+        free(b->time);
+        free(b->node);
+        for (f = 0; f < NR_FIELDS; f++)
+                free(b->col[f]);
+        free(b);
+        return NULL;
+}
+
+/*
+ * bin_add_interval -- append the nodes of interval as rows
+ */
+static void bin_add_interval(struct m2n_ctx *ctx)
+{
+        struct numa_stat *s = ctx->stats;
+        struct bin_block *b;
+        int i, f;
+
+        if (ctx->bin == NULL && (ctx->bin = bin_alloc()) == NULL) {
+                fprintf(stderr, "No memory!\n");
+                exit(EXIT_FAILURE);
+        }
+        b = ctx->bin;
+
+        for (i = 0; i < topo.nr_nodes; i++) {
+                if (b->nr_rows == BIN_BLOCK_ROWS)
+                        bin_flush(ctx);
+                strncpy(b->time[b->nr_rows], s[i].time, BIN_TIME_LEN);
+                b->time[b->nr_rows][BIN_TIME_LEN - 1] = '\0';
+                b->node[b->nr_rows] = i;
+                for (f = 0; f < NR_FIELDS; f++)
+                        b->col[f][b->nr_rows] = FIELD(&s[i], f);
+                b->nr_rows++;
+        }
+        memset(s, 0, topo.nr_nodes * sizeof(*s));
+}
+
+/*
+ * Summary of -summary: a histogram per node per field (and %util) of the
+ * node average in hundredths of percent. Every value a node can have has
+ * its own bucket, so percentiles are exact and memory does not grow with
+ * the length of capture.
+ */
+#define SUM_UTIL        NR_FIELDS       /* %util column of summary */
+#define NR_SUM_COLS     (NR_FIELDS + 1)
+
+struct hist {
+        uint32_t *count;        /* HIST_BUCKETS entries */
+        uint64_t n;
+        int64_t sum;
+        int max;
+        char max_time[32];      /* Time of first max */
+};
+
+struct summary {
+        long nr_ivals;
+        char first_time[32];
+        char last_time[32];
+        struct hist *hist;      /* nr_nodes * NR_SUM_COLS */
+        long *hot;              /* Intervals node had the highest %util */
+        struct hist imbal;      /* max - min %util of nodes per interval */
+};
+
+static int *const field_flags[] = {
+        &usr_flag, &nice_flag, &sys_flag, &iowait_flag, &irq_flag,
+        &soft_flag, &steal_flag, &guest_flag, &gnice_flag, &idle_flag,
+};
+
+static int hist_init(struct hist *h)
+{
+        memset(h, 0, sizeof(*h));
+        h->count = calloc(HIST_BUCKETS, sizeof(*h->count));
+        h->max = -1;
+        return h->count ? 0 : -1;
+}
+
+static void hist_add(struct hist *h, int v, const char *time)
+{
+        if (v < 0)
+                v = 0;
+        if (v >= HIST_BUCKETS)
+                v = HIST_BUCKETS - 1;
+        h->count[v]++;
+        h->n++;
+        h->sum += v;
+        if (v > h->max) {
+                h->max = v;
+                strcpy(h->max_time, time);
+        }
+}
+
+/*
+ * hist_pct -- nearest rank percentile in hundredths of percent
+ */
+static int hist_pct(const struct hist *h, int pct)
+{
+        uint64_t rank, seen = 0;
+        int v;
+
+        rank = (h->n * pct + 99) / 100;
+        if (rank == 0)
+                rank = 1;
+        for (v = 0; v < HIST_BUCKETS; v++) {
+                seen += h->count[v];
+                if (seen >= rank)
+                        return v;
+        }
+        return h->max;
+}
+
+void summary_free(struct m2n_ctx *ctx)
+{
+        struct summary *sum = ctx->sum;
+        int i;
+
+        if (sum == NULL)
+                return;
+        if (sum->hist) {
+                for (i = 0; i < topo.nr_nodes * NR_SUM_COLS; i++)
+                        free(sum->hist[i].count);
+        }
+        free(sum->hist);
+        free(sum->imbal.count);
+        free(sum->hot);
+        free(sum);
+        ctx->sum = NULL;
+}
+
+static struct summary *summary_alloc(void)
+{
+        struct summary *sum;
+        int i, ret;
+
+        sum = calloc(1, sizeof(*sum));
+        if (sum == NULL)
+                return NULL;
+        sum->hist = calloc(topo.nr_nodes * NR_SUM_COLS, sizeof(*sum->hist));
+        sum->hot = calloc(topo.nr_nodes, sizeof(*sum->hot));
+        ret = hist_init(&sum->imbal);
+        if (sum->hist) {
+                for (i = 0; i < topo.nr_nodes * NR_SUM_COLS; i++)
+                        ret |= hist_init(&sum->hist[i]);
+        }
+        if (ret || sum->hist == NULL || sum->hot == NULL) {
+                struct m2n_ctx tmp = { .sum = sum };
+
+                summary_free(&tmp);
+                return NULL;
+        }
+        return sum;
+}
+
+/*
+ * summary_add -- add the interval to histograms, the node of highest
+ *                %util and the spread of %util are taken per interval.
+ */
+static void summary_add(struct m2n_ctx *ctx)
+{
+        struct numa_stat *s = ctx->stats;
+        struct summary *sum;
+        struct hist *h;
+        int i, f, c, v, util, hot = -1, min = INT_MAX, max = 0;
+
+        if (ctx->sum == NULL && (ctx->sum = summary_alloc()) == NULL) {
+                fprintf(stderr, "No memory!\n");
+                exit(EXIT_FAILURE);
+        }
+        sum = ctx->sum;
+        if (sum->nr_ivals++ == 0)
+                strcpy(sum->first_time, s[0].time);
+        strcpy(sum->last_time, s[0].time);
+
+        for (i = 0; i < topo.nr_nodes; i++) {
+                /* Memory only node */
+                if (topo.node_cpus[i] == 0)
+                        continue;
+                c = topo.node_cpus[i];
+                h = &sum->hist[i * NR_SUM_COLS];
+                for (f = 0; f < NR_FIELDS; f++) {
+                        v = (FIELD(&s[i], f) + c / 2) / c;
+                        hist_add(&h[f], v, s[i].time);
+                }
+                util = 10000 - (s[i].idle + c / 2) / c;
+                hist_add(&h[SUM_UTIL], util, s[i].time);
+
+                if (hot < 0 || util > max) {
+                        hot = i;
+                        max = util;
+                }
+                if (util < min)
+                        min = util;
+        }
+        if (hot >= 0) {
+                sum->hot[hot]++;
+                hist_add(&sum->imbal, max - min, s[0].time);
+        }
+        memset(s, 0, topo.nr_nodes * sizeof(*s));
+}
+
+static void summary_row(FILE *out, const char *node, const char *name,
+                        const struct hist *h)
+{
+        fprintf(out, "%4s %-8s%8.2f%8.2f%8.2f%8.2f%8.2f  %s\n", node, name,
+                h->n ? (double)h->sum / h->n / 100 : 0.0,
+                hist_pct(h, 50) / 100.0, hist_pct(h, 95) / 100.0,
+                hist_pct(h, 99) / 100.0, h->max / 100.0, h->max_time);
+}
+
+/*
+ * summary_print -- print percentiles of the selected fields per node, the
+ *                  hottest node and the imbalance of nodes.
+ */
+void summary_print(struct m2n_ctx *ctx)
+{
+        struct summary *sum = ctx->sum;
+        FILE *out = ctx->out;
+        const struct hist *h;
+        char name[16], nid[16];
+        int i, f, hot = -1;
+
+        if (sum == NULL || sum->nr_ivals == 0)
+                return;
+
+        if (header_flag) {
+                fprintf(out, "\nSummary of %s: %ld intervals, %s - %s\n",
+                        ctx->fn, sum->nr_ivals, sum->first_time,
+                        sum->last_time);
+                fprintf(out, "\n%4s %-8s%8s%8s%8s%8s%8s  %s\n", "NODE",
+                        "FIELD", "mean", "p50", "p95", "p99", "max",
+                        "MAX_TIME");
+        }
+        for (i = 0; i < topo.nr_nodes; i++) {
+                if (topo.node_cpus[i] == 0)
+                        continue;
+                h = &sum->hist[i * NR_SUM_COLS];
+                if (hot < 0 || h[SUM_UTIL].sum > sum->hist[hot *
+                                NR_SUM_COLS + SUM_UTIL].sum)
+                        hot = i;
+                if (node != -1 && i != node)
+                        continue;
+                snprintf(nid, sizeof(nid), "%d", i);
+                for (f = 0; f < NR_SUM_COLS; f++) {
+                        if (f == FIELD_GNICE && !ctx->gnice)
+                                continue;
+                        if (!print_all && !(f == SUM_UTIL ? util_flag :
+                                            *field_flags[f]))
+                                continue;
+                        snprintf(name, sizeof(name), "%%%s",
+                                 f == SUM_UTIL ? "util" : fields[f].name);
+                        summary_row(out, nid, name, &h[f]);
+                }
+        }
+        if (gnice_flag && !ctx->gnice)
+                fprintf(out, "No gnice included by mpstat!\n");
+        if (hot < 0)
+                return;
+
+        h = &sum->hist[hot * NR_SUM_COLS + SUM_UTIL];
+        fprintf(out, "\nHottest node       : %d, mean %%util %.2f, highest "
+                "in %ld of %ld intervals\n", hot,
+                (double)h->sum / h->n / 100, sum->hot[hot], sum->nr_ivals);
+        if (header_flag)
+                fprintf(out, "Imbalance          : max - min %%util of nodes "
+                        "per interval\n");
+        summary_row(out, "ALL", "%imbal", &sum->imbal);
+}
+
+void emit_numa_stat(struct m2n_ctx *ctx);
+
+/*
+ * parse_time -- convert "hh:mm:ss[.mmm][ AM|PM]" to seconds of the day
+ *
+ * Return -1 if it is not a time.
+ */
+int parse_time(const char *s)
+{
+        int h, m, sec = 0, n = 0;
+
+        if (sscanf(s, "%2d:%2d%n:%2d%n", &h, &m, &n, &sec, &n) < 2)
+                return -1;
+        s += n;
+        if (*s == '.')
+                while (isdigit(*++s))
+                        ;
+        while (*s == ' ')
+                s++;
+        if ((s[0] == 'A' || s[0] == 'P') && s[1] == 'M') {
+                if (h < 1 || h > 12)
+                        return -1;
+                h = h % 12 + (s[0] == 'P' ? 12 : 0);
+        }
+        if (h > 23 || m > 59 || sec > 59)
+                return -1;
+        return h * 3600 + m * 60 + sec;
+}
+
+/*
+ * in_window -- check time of day against -from/-to, the window wraps
+ *              midnight if -from is later than -to.
+ */
+static int in_window(int t)
+{
+        if (t < 0)
+                return 1;
+        if (from_sec <= to_sec)
+                return t >= from_sec && t <= to_sec;
+        return t >= from_sec || t <= to_sec;
+}
+
+static void output_numa_stat(struct m2n_ctx *ctx)
+{
+        if (summary_flag) {
+                summary_add(ctx);
+                return;
+        }
+        if (bin_fp) {
+                bin_add_interval(ctx);
+                return;
+        }
+        emit_numa_stat(ctx);
+}
+
+/*
+ * resample_flush -- output the average of pending intervals of -resample,
+ *                   stamped with time of the last one.
+ */
+void resample_flush(struct m2n_ctx *ctx)
+{
+        struct numa_stat *s = ctx->stats, *rs = ctx->rs;
+        int i, f, n = ctx->rs_n;
+
+        if (n == 0)
+                return;
+        for (i = 0; i < topo.nr_nodes; i++) {
+                memcpy(s[i].time, rs[i].time, sizeof(s[i].time));
+                for (f = 0; f < NR_FIELDS; f++)
+                        FIELD(&s[i], f) = (FIELD(&rs[i], f) + n / 2) / n;
+        }
+        memset(rs, 0, topo.nr_nodes * sizeof(*rs));
+        ctx->rs_n = 0;
+        output_numa_stat(ctx);
+}
+
+static void resample_add(struct m2n_ctx *ctx)
+{
+        struct numa_stat *s = ctx->stats, *rs;
+        int i, f;
+
+        if (ctx->rs == NULL &&
+            (ctx->rs = calloc(topo.nr_nodes, sizeof(*ctx->rs))) == NULL) {
+                fprintf(stderr, "No memory!\n");
+                exit(EXIT_FAILURE);
+        }
+        rs = ctx->rs;
+        for (i = 0; i < topo.nr_nodes; i++) {
+                memcpy(rs[i].time, s[i].time, sizeof(s[i].time));
+                for (f = 0; f < NR_FIELDS; f++)
+                        FIELD(&rs[i], f) += FIELD(&s[i], f);
+        }
+        memset(s, 0, topo.nr_nodes * sizeof(*s));
+        if (++ctx->rs_n == resample)
+                resample_flush(ctx);
+}
+
+void print_numa_stat(struct m2n_ctx *ctx)
+{
+        /* Don't print for first run */
+        if (ctx->first == 0) {
+                ctx->first++;
+                return;
+        }
+
+        if (window_flag && !in_window(parse_time(ctx->stats[0].time))) {
+                memset(ctx->stats, 0, topo.nr_nodes * sizeof(*ctx->stats));
+                return;
+        }
+        if (resample > 1) {
+                resample_add(ctx);
+                return;
+        }
+        output_numa_stat(ctx);
+}
+
+/*
+ * emit_numa_stat -- print the interval as text by the selected printer
+ */
+void emit_numa_stat(struct m2n_ctx *ctx)
+{
+        if (print_all || print_fields > 1) {
+                print_stat_multi(ctx);
+                return;
+        }
+#define check_print_and_return(field) do {      \
+        if (field ## _flag) {                   \
+                print_stat_##field(ctx);        \
+                return;                         \
+        }                                       \
+} while (0)
+
+        check_print_and_return(usr);
+        check_print_and_return(nice);
+        check_print_and_return(sys);
+        check_print_and_return(iowait);
+        check_print_and_return(irq);
+        check_print_and_return(soft);
+        check_print_and_return(steal);
+        check_print_and_return(guest);
+        check_print_and_return(idle);
+        check_print_and_return(util);
+        if (gnice_flag) {
+                if (ctx->gnice) {
+                        print_stat_gnice(ctx);
+                        return;
+                }
+                fprintf(ctx->out, "No gnice included by mpstat!\n");
+                ctx->stop = 1;
+        }
+
+        return;
+}
+
+enum line_type {
+        LINE_SKIP,              /* Empty, Average or unknown line */
+        LINE_HEADER,            /* "hh:mm:ss CPU %usr ..." */
+        LINE_ALL,               /* "hh:mm:ss all ..." */
+        LINE_CPU,               /* "hh:mm:ss N ..." */
+};
+
+/*
+ * One parsed mpstat line, time points into the line buffer. Values of CPU
+ * line are left to parse_vals() so they are stored to where they are
+ * aggregated without an extra copy.
+ */
+struct mpstat_line {
+        const char *time;
+        int time_len;
+        int cpu;
+        int gnice;              /* Header includes %gnice */
+        const char *vals;       /* Values of CPU line */
+        const char *end;
+};
+
+#define is_digit(c)     ((unsigned char)((c) - '0') < 10)
+#define is_blank(c)     ((c) == ' ' || (c) == '\t')
+#define is_tokend(c)    (is_blank(c) || (c) == '\n' || (c) == '\r')
+
+/*
+ * parse_fixed -- parse "%.2f" formatted value into hundredths.
+ *
+ * Return pointer after the value, NULL if not a number.
+ */
+static inline const char *parse_fixed(const char *p, const char *end,
+                                      long *val)
+{
+        const char *start;
+        long v = 0;
+        int neg = 0, i;
+
+        if (p < end && *p == '-') {
+                neg = 1;
+                p++;
+        }
+        start = p;
+        while (p < end && is_digit(*p))
+                v = v * 10 + (*p++ - '0');
+        if (p == start)
+                return NULL;
+
+        /* Decimal point depends on locale of mpstat */
+        if (p < end && (*p == '.' || *p == ',')) {
+                p++;
+                for (i = 0; i < 2; i++) {
+                        v *= 10;
+                        if (p < end && is_digit(*p))
+                                v += *p++ - '0';
+                }
+                while (p < end && is_digit(*p))
+                        p++;
+        } else {
+                v *= 100;
+        }
+
+        *val = neg ? -v : v;
+        return p;
+}
+
+/*
+ * parse_line -- tokenize one mpstat line, walk the line once.
+ *
+ * Return type of the line, fields of @ml are valid for LINE_HEADER (time,
+ * gnice) and LINE_CPU only. A CPU line of a cpu beyond the topology is
+ * LINE_SKIP. Values of LINE_CPU are not checked here, see parse_vals().
+ */
+int parse_line(const char *line, size_t len, struct mpstat_line *ml)
+{
+        const char *p = line, *end = line + len;
+
+        /* Empty, "Average:" or not start with time */
+        if (len < 5 || line[0] < '0' || line[0] > '2')
+                return LINE_SKIP;
+
+        /* Time, "hh:mm:ss" or "hh:mm:ss AM" */
+        ml->time = p;
+        while (p < end && !is_tokend(*p))
+                p++;
+        while (p < end && is_blank(*p))
+                p++;
+        if (end - p > 2 && (p[0] == 'A' || p[0] == 'P') && p[1] == 'M' &&
+            is_tokend(p[2])) {
+                p += 2;
+        }
+        ml->time_len = p - line;
+        while (ml->time_len > 0 && is_blank(line[ml->time_len - 1]))
+                ml->time_len--;
+        if (ml->time_len >= sizeof(((struct numa_stat *)0)->time))
+                return LINE_SKIP;
+        while (p < end && is_blank(*p))
+                p++;
+        if (p == end)
+                return LINE_SKIP;
+
+        if (*p == 'C') {
+                if (end - p < 3 || memcmp(p, "CPU", 3))
+                        return LINE_SKIP;
+                ml->gnice = memmem(p, end - p, "%gnice", 6) != NULL;
+                return LINE_HEADER;
+        }
+
+        if (*p == 'a')
+                return LINE_ALL;
+
+        if (!is_digit(*p))
+                return LINE_SKIP;
+        ml->cpu = 0;
+        while (p < end && is_digit(*p)) {
+                ml->cpu = ml->cpu * 10 + (*p++ - '0');
+                /* Not in topology, and bound before it can overflow */
+                if (ml->cpu >= topo.nr_cpus)
+                        return LINE_SKIP;
+        }
+        ml->vals = p;
+        ml->end = end;
+        return LINE_CPU;
+}
+
+/*
+ * parse_vals -- parse values of CPU line to @slot of columns, columns are
+ *               in the order of fields[]. A row is parsed by columns
+ *               pointing to each member of the row and slot 0.
+ *
+ * Return 0 if success, -1 if the line is truncated or invalid.
+ */
+static inline int parse_vals(const struct mpstat_line *ml,
+                             int32_t *const *col, int slot)
+{
+        const char *p = ml->vals, *end = ml->end;
+        long v;
+        int n;
+
+        for (n = 0; n < MAX_VALS; n++) {
+                while (p < end && is_blank(*p))
+                        p++;
+                if (p == end || *p == '\n' || *p == '\r')
+                        break;
+                p = parse_fixed(p, end, &v);
+                if (p == NULL)
+                        return -1;
+                col[n][slot] = v;
+        }
+
+        /* Truncated line */
+        if (n < MAX_VALS - 1)
+                return -1;
+
+        /* No gnice column, it was parsed to gnice */
+        if (n == MAX_VALS - 1) {
+                col[FIELD_IDLE][slot] = col[FIELD_GNICE][slot];
+                col[FIELD_GNICE][slot] = 0;
+        }
+        return 0;
+}
+
+/*
+ * Vector sum of a column, the kernel is selected by simd_init() by the
+ * features of running CPU. Lanes are int32, values are at most 10000 so
+ * they don't overflow with less than 1M CPUs per node.
+ */
+static long sum_i32_scalar(const int32_t *p, int n)
+{
+        long sum = 0;
+        int i;
+
+        for (i = 0; i < n; i++)
+                sum += p[i];
+        return sum;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static long sum_i32_sse2(const int32_t *p, int n)
+{
+        __m128i acc = _mm_setzero_si128();
+        long sum;
+        int i;
+
+        for (i = 0; i + 4 <= n; i += 4)
+                acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i *)(p + i)));
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+        sum = _mm_cvtsi128_si32(acc);
+        for (; i < n; i++)
+                sum += p[i];
+        return sum;
+}
+
+__attribute__((target("avx2")))
+static long sum_i32_avx2(const int32_t *p, int n)
+{
+        __m256i acc = _mm256_setzero_si256();
+        __m128i s;
+        long sum;
+        int i;
+
+        for (i = 0; i + 8 <= n; i += 8)
+                acc = _mm256_add_epi32(acc,
+                        _mm256_loadu_si256((const __m256i *)(p + i)));
+        s = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                          _mm256_extracti128_si256(acc, 1));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+        sum = _mm_cvtsi128_si32(s);
+        for (; i < n; i++)
+                sum += p[i];
+        return sum;
+}
+#endif
+
+static const struct sum_kernel {
+        const char *name;
+        long (*fn)(const int32_t *p, int n);
+} sum_kernels[] = {
+        { "scalar",     sum_i32_scalar },
+#ifdef HAVE_X86_SIMD
+        { "sse2",       sum_i32_sse2 },
+        { "avx2",       sum_i32_avx2 },
+#endif
+};
+
+long (*sum_i32)(const int32_t *p, int n) = sum_i32_scalar;
+
+static int sum_kernel_supported(const struct sum_kernel *k)
+{
+#ifdef HAVE_X86_SIMD
+        if (k->fn == sum_i32_sse2)
+                return __builtin_cpu_supports("sse2");
+        if (k->fn == sum_i32_avx2)
+                return __builtin_cpu_supports("avx2");
+#endif
+        return 1;
+}
+
+void simd_init(void)
+{
+        int i;
+
+        for (i = 0; i < sizeof(sum_kernels) / sizeof(*sum_kernels); i++) {
+                if (sum_kernel_supported(&sum_kernels[i]))
+                        sum_i32 = sum_kernels[i].fn;
+        }
+}
+
+int soa_init(struct soa *a)
+{
+        int f;
+
+        memset(a, 0, sizeof(*a));
+        for (f = 0; f < NR_FIELDS; f++) {
+                a->col[f] = calloc(topo.nr_slots ? topo.nr_slots : 1,
+                                   sizeof(int32_t));
+                if (a->col[f] == NULL)
+                        return -1;
+        }
+        return 0;
+}
+
+void soa_free(struct soa *a)
+{
+        int f;
+
+        for (f = 0; f < NR_FIELDS; f++) {
+                free(a->col[f]);
+                a->col[f] = NULL;
+        }
+}
+
+static inline void soa_set_time(struct soa *a, const char *time, int len)
+{
+        memcpy(a->time, time, len);
+        a->time[len] = '\0';
+        a->has_time = 1;
+}
+
+/*
+ * soa_add -- parse the values of CPU line to its slot, time of the
+ *            interval is copied by the first CPU line only.
+ */
+static inline void soa_add(struct soa *a, int slot,
+                           const struct mpstat_line *ml)
+{
+        int f;
+
+        if (parse_vals(ml, a->col, slot)) {
+                /* Drop the partial values */
+                for (f = 0; f < NR_FIELDS; f++)
+                        a->col[f][slot] = 0;
+                return;
+        }
+        if (!a->has_time)
+                soa_set_time(a, ml->time, ml->time_len);
+}
+
+/*
+ * soa_reduce -- add the interval to node stats and reset it
+ */
+void soa_reduce(struct soa *a, struct numa_stat *stats)
+{
+        int n, f, lo, cnt;
+
+        if (!a->has_time)
+                return;
+
+        for (n = 0; n < topo.nr_nodes; n++) {
+                lo = topo.node_off[n];
+                cnt = topo.node_off[n + 1] - lo;
+                for (f = 0; f < NR_FIELDS; f++)
+                        FIELD(&stats[n], f) += sum_i32(a->col[f] + lo, cnt);
+                memcpy(stats[n].time, a->time, sizeof(a->time));
+        }
+
+        /* CPUs may be missed in next interval */
+        for (f = 0; f < NR_FIELDS; f++)
+                memset(a->col[f], 0, topo.nr_slots * sizeof(int32_t));
+        a->has_time = 0;
+}
+
+/*
+ * add_numa_stat -- the array of structs aggregation per CPU line, kept as
+ *                  the baseline of -bench.
+ */
+void add_numa_stat(struct numa_stat *to, const struct mpstat_line *ml,
+                   const int32_t *v)
+{
+        memcpy(to->time, ml->time, ml->time_len);
+        to->time[ml->time_len] = '\0';
+
+        to->usr += v[0];
+        to->nice += v[1];
+        to->sys += v[2];
+        to->iowait += v[3];
+        to->irq += v[4];
+        to->soft += v[5];
+        to->steal += v[6];
+        to->guest += v[7];
+        to->gnice += v[8];
+        to->idle += v[9];
+}
+
+
+/*
+ * Buffered line reader of stream (pipe, stdin or decompressor output),
+ * lines are returned in place of the buffer.
+ */
+struct line_reader {
+        int fd;
+        char *buf;
+        size_t cap;
+        size_t start;           /* Start of unread data */
+        size_t end;             /* End of data */
+        int eof;
+        int err;
+};
+
+static int lr_init(struct line_reader *lr, int fd, const char *data,
+                   size_t len)
+{
+        memset(lr, 0, sizeof(*lr));
+        lr->fd = fd;
+        lr->cap = READ_SIZE;
+        lr->buf = malloc(lr->cap);
+        if (lr->buf == NULL)
+                return -1;
+        memcpy(lr->buf, data, len);
+        lr->end = len;
+        return 0;
+}
+
+/*
+ * lr_getline -- get next line, the line includes '\n' if there is.
+ *
+ * Return length of line, -1 on EOF or error.
+ */
+static ssize_t lr_getline(struct line_reader *lr, char **line)
+{
+        char *nl, *p;
+        ssize_t n;
+
+        for (;;) {
+                nl = memchr(lr->buf + lr->start, '\n', lr->end - lr->start);
+                if (nl != NULL || (lr->eof && lr->start < lr->end)) {
+                        *line = lr->buf + lr->start;
+                        n = nl ? nl + 1 - *line : (ssize_t)(lr->end - lr->start);
+                        lr->start += n;
+                        return n;
+                }
+                if (lr->eof)
+                        return -1;
+
+                /* Move the partial line to head, grow for long line */
+                if (lr->start) {
+                        memmove(lr->buf, lr->buf + lr->start,
+                                lr->end - lr->start);
+                        lr->end -= lr->start;
+                        lr->start = 0;
+                }
+                if (lr->end == lr->cap) {
+                        p = realloc(lr->buf, lr->cap * 2);
+                        if (p == NULL) {
+                                lr->err = ENOMEM;
+                                return -1;
+                        }
+                        lr->buf = p;
+                        lr->cap *= 2;
+                }
+
+                n = read(lr->fd, lr->buf + lr->end, lr->cap - lr->end);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        lr->err = errno;
+                        return -1;
+                }
+                if (n == 0)
+                        lr->eof = 1;
+                lr->end += n;
+        }
+}
+
+/*
+ * process_stream -- aggregate the stream line by line, it is used when
+ *                   the input can not be mmaped or -cpu is given.
+ */
+static int process_stream(struct m2n_ctx *ctx, struct line_reader *lr)
+{
+        char *line;
+        ssize_t read;
+        struct mpstat_line ml;
+        int print_lines = 0;
+        int slot;
+
+        while (!ctx->stop && (read = lr_getline(lr, &line)) != -1) {
+                switch (parse_line(line, read, &ml)) {
+                case LINE_HEADER:
+                        /* output include gnice? */
+                        if (ml.gnice)
+                                ctx->gnice = 1;
+
+                        /* Only want to get given CPU stat */
+                        if (cpu >= 0) {
+                                if (header_flag == 1 &&
+                                    print_lines % NR_HLINES == 0) {
+                                        fputc('\n', ctx->out);
+                                        fwrite(line, 1, read, ctx->out);
+                                }
+                                continue;
+                        }
+                        soa_reduce(&ctx->soa, ctx->stats);
+                        print_numa_stat(ctx);
+                        continue;
+
+                case LINE_CPU:
+                        if (cpu != -1 && ml.cpu == cpu) {
+                                print_lines++;
+                                fwrite(line, 1, read, ctx->out);
+                                continue;
+                        }
+
+                        /* CPU not covered by topology */
+                        if (ml.cpu >= topo.nr_cpus ||
+                            (slot = topo.cpu2slot[ml.cpu]) < 0)
+                                continue;
+                        soa_add(&ctx->soa, slot, &ml);
+                        continue;
+
+                default:
+                        continue;
+                }
+        }
+        soa_reduce(&ctx->soa, ctx->stats);
+
+        return lr->err ? -1 : 0;
+}
+
+/*
+ * A chunk of mmaped file, it always starts at a header line (except the
+ * first one of file) so no interval crosses chunks. Workers aggregate the
+ * intervals of the chunk to ivals, main thread replays them in file order.
+ */
+struct chunk {
+        const char *start;
+        const char *end;
+        int nr_ivals;
+        int max_ivals;
+        char *header;           /* Interval starts with header line */
+        char *gnice;            /* Header of interval includes %gnice */
+        struct numa_stat *ivals;/* nr_ivals * topo.nr_nodes */
+        struct soa soa;
+        pthread_t thread;
+        int threaded;
+        int err;
+};
+
+static struct numa_stat *chunk_new_ival(struct chunk *c, int header, int gn)
+{
+        int max;
+        void *p;
+
+        if (c->nr_ivals == c->max_ivals) {
+                max = c->max_ivals ? c->max_ivals * 2 : 64;
+                p = realloc(c->ivals, max * topo.nr_nodes * sizeof(*c->ivals));
+                if (p == NULL)
+                        return NULL;
+                c->ivals = p;
+                if ((p = realloc(c->header, max)) == NULL)
+                        return NULL;
+                c->header = p;
+                if ((p = realloc(c->gnice, max)) == NULL)
+                        return NULL;
+                c->gnice = p;
+                c->max_ivals = max;
+        }
+
+        c->header[c->nr_ivals] = header;
+        c->gnice[c->nr_ivals] = gn;
+        p = &c->ivals[c->nr_ivals * topo.nr_nodes];
+        memset(p, 0, topo.nr_nodes * sizeof(*c->ivals));
+        c->nr_ivals++;
+        return p;
+}
+
+static void *aggregate_chunk(void *arg)
+{
+        struct chunk *c = arg;
+        const char *p, *nl;
+        struct numa_stat *s;
+        struct mpstat_line ml;
+        int slot;
+
+        c->nr_ivals = 0;
+        c->err = 0;
+        if (c->soa.col[0] == NULL && soa_init(&c->soa))
+                goto nomem;
+        /* Lines before the first header */
+        s = chunk_new_ival(c, 0, 0);
+        if (s == NULL)
+                goto nomem;
+
+        for (p = c->start; p < c->end; p = nl + 1) {
+                nl = memchr(p, '\n', c->end - p);
+                if (nl == NULL)
+                        nl = c->end;
+
+                switch (parse_line(p, nl - p, &ml)) {
+                case LINE_HEADER:
+                        soa_reduce(&c->soa, s);
+                        s = chunk_new_ival(c, 1, ml.gnice);
+                        if (s == NULL)
+                                goto nomem;
+                        break;
+                case LINE_CPU:
+                        if (ml.cpu >= topo.nr_cpus ||
+                            (slot = topo.cpu2slot[ml.cpu]) < 0)
+                                break;
+                        soa_add(&c->soa, slot, &ml);
+                        break;
+                default:
+                        break;
+                }
+        }
+        soa_reduce(&c->soa, s);
+        return NULL;
+
+nomem:
+        c->err = -1;
+        return NULL;
+}
+
+/*
+ * replay_chunk -- feed intervals of chunk to print_numa_stat() as if
+ *                 they were read by process_stream().
+ */
+static void replay_chunk(struct m2n_ctx *ctx, struct chunk *c)
+{
+        struct numa_stat *s, *stats = ctx->stats;
+        int i, n, f;
+
+        for (i = 0; i < c->nr_ivals && !ctx->stop; i++) {
+                if (c->header[i]) {
+                        if (c->gnice[i])
+                                ctx->gnice = 1;
+                        print_numa_stat(ctx);
+                }
+                s = &c->ivals[i * topo.nr_nodes];
+                for (n = 0; n < topo.nr_nodes; n++) {
+                        if (s[n].time[0])
+                                memcpy(stats[n].time, s[n].time,
+                                       sizeof(s[n].time));
+                        for (f = 0; f < NR_FIELDS; f++)
+                                FIELD(&stats[n], f) += FIELD(&s[n], f);
+                }
+        }
+}
+
+/*
+ * next_header -- return the start of first header line at or after @p
+ */
+static const char *next_header(const char *p, const char *start,
+                               const char *end)
+{
+        const char *nl;
+        struct mpstat_line ml;
+
+        /* Move to start of line */
+        while (p > start && p[-1] != '\n')
+                p--;
+        for (; p < end; p = nl + 1) {
+                nl = memchr(p, '\n', end - p);
+                if (nl == NULL)
+                        return end;
+                if (parse_line(p, nl - p, &ml) == LINE_HEADER)
+                        return p;
+        }
+        return end;
+}
+
+/*
+ * process_mapped -- mmap the file and aggregate it by ctx->nr_jobs
+ *                   workers, each round hands up to CHUNK_SIZE bytes to
+ *                   a worker.
+ */
+static int process_mapped(struct m2n_ctx *ctx, const char *map, size_t size)
+{
+        int nr_jobs = ctx->nr_jobs;
+        struct chunk *chunks;
+        const char *pos = map, *end = map + size;
+        int i, n, ret = 0;
+
+        chunks = calloc(nr_jobs, sizeof(*chunks));
+        if (chunks == NULL)
+                return -1;
+
+        while (pos < end && ret == 0 && !ctx->stop) {
+                for (n = 0; n < nr_jobs && pos < end; n++) {
+                        chunks[n].start = pos;
+                        if ((size_t)(end - pos) <= CHUNK_SIZE)
+                                pos = end;
+                        else
+                                pos = next_header(pos + CHUNK_SIZE, pos, end);
+                        chunks[n].end = pos;
+                }
+
+                /* Run the chunk inline if no more thread */
+                for (i = 0; i < n; i++) {
+                        chunks[i].threaded = n > 1 &&
+                                !pthread_create(&chunks[i].thread, NULL,
+                                                aggregate_chunk, &chunks[i]);
+                        if (!chunks[i].threaded)
+                                aggregate_chunk(&chunks[i]);
+                }
+                for (i = 0; i < n; i++) {
+                        if (chunks[i].threaded)
+                                pthread_join(chunks[i].thread, NULL);
+                        if (chunks[i].err)
+                                ret = -1;
+                }
+                for (i = 0; i < n && ret == 0; i++)
+                        replay_chunk(ctx, &chunks[i]);
+        }
+
+        for (i = 0; i < nr_jobs; i++) {
+                soa_free(&chunks[i].soa);
+                free(chunks[i].ivals);
+                free(chunks[i].header);
+                free(chunks[i].gnice);
+        }
+        free(chunks);
+        return ret;
+}
+
+/*
+ * Sidecar index of input (-index), "<file>.m2nidx" in host byte order:
+ * struct idx_header, then one struct idx_entry per header line of the
+ * input. The index is rebuilt if size or mtime of the input changed.
+ */
+struct idx_header {
+        char magic[8];
+        uint64_t size;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        uint64_t nr;
+};
+
+struct idx_entry {
+        uint64_t off;           /* Offset of header line */
+        int32_t sec;            /* Time of day, -1 if unknown */
+        uint32_t reserved;
+};
+
+static void idx_header_init(struct idx_header *h, const struct stat *st,
+                            size_t nr)
+{
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, IDX_MAGIC, sizeof(IDX_MAGIC));
+        h->size = st->st_size;
+        h->mtime_sec = st->st_mtim.tv_sec;
+        h->mtime_nsec = st->st_mtim.tv_nsec;
+        h->nr = nr;
+}
+
+/*
+ * idx_load -- read the index of input, return NULL if it is missing or
+ *             stale.
+ */
+static struct idx_entry *idx_load(const char *path, const struct stat *st,
+                                  size_t *nr)
+{
+        struct idx_header h, want;
+        struct idx_entry *e = NULL;
+        FILE *fp;
+
+        fp = fopen(path, "r");
+        if (fp == NULL)
+                return NULL;
+        idx_header_init(&want, st, 0);
+        if (fread(&h, sizeof(h), 1, fp) != 1 ||
+            memcmp(h.magic, want.magic, sizeof(h.magic)) ||
+            h.size != want.size || h.mtime_sec != want.mtime_sec ||
+            h.mtime_nsec != want.mtime_nsec || h.nr > h.size)
+                goto out;
+        e = malloc((h.nr ? h.nr : 1) * sizeof(*e));
+        if (e && fread(e, sizeof(*e), h.nr, fp) != h.nr) {
+                free(e);
+                e = NULL;
+        }
+        *nr = h.nr;
+out:
+        fclose(fp);
+        return e;
+}
+
+/*
+ * idx_build -- find the header lines of mapped input
+ */
+static struct idx_entry *idx_build(const char *map, size_t size, size_t *nr)
+{
+        const char *p, *nl, *end = map + size;
+        struct mpstat_line ml;
+        struct idx_entry *e = NULL, *tmp;
+        size_t n = 0, max = 0;
+        char time[32];
+
+        for (p = map; p < end; p = nl + 1) {
+                nl = memchr(p, '\n', end - p);
+                if (nl == NULL)
+                        nl = end;
+                if (parse_line(p, nl - p, &ml) != LINE_HEADER)
+                        continue;
+                if (n == max) {
+                        max = max ? max * 2 : 1024;
+                        tmp = realloc(e, max * sizeof(*e));
+                        if (tmp == NULL) {
+                                free(e);
+                                return NULL;
+                        }
+                        e = tmp;
+                }
+                memcpy(time, ml.time, ml.time_len);
+                time[ml.time_len] = '\0';
+                e[n].off = p - map;
+                e[n].sec = parse_time(time);
+                e[n].reserved = 0;
+                n++;
+        }
+        if (e == NULL)
+                e = malloc(sizeof(*e));
+        *nr = n;
+        return e;
+}
+
+/*
+ * idx_save -- write the index to a temporary file and rename it over, so
+ *             a concurrent query never reads a partial index.
+ */
+static int idx_save(const char *path, const struct stat *st,
+                    const struct idx_entry *e, size_t nr)
+{
+        struct idx_header h;
+        char tmp[PATH_MAX + 32];
+        FILE *fp;
+        int ret;
+
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+        fp = fopen(tmp, "w");
+        if (fp == NULL)
+                return -1;
+        idx_header_init(&h, st, nr);
+        ret = fwrite(&h, sizeof(h), 1, fp) != 1 ||
+              fwrite(e, sizeof(*e), nr, fp) != nr;
+        if (fclose(fp) || ret || rename(tmp, path)) {
+                unlink(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * process_indexed -- process the mapped input by its index, only runs of
+ *                    intervals in -from/-to window are aggregated.
+ */
+static int process_indexed(struct m2n_ctx *ctx, const char *map,
+                           const struct stat *st)
+{
+        struct idx_entry *e;
+        char path[PATH_MAX + 16];
+        size_t i, nr, size = st->st_size;
+        long start = -1;
+        int ret = 0;
+
+        snprintf(path, sizeof(path), "%s" IDX_SUFFIX, ctx->fn);
+        e = idx_load(path, st, &nr);
+        if (e == NULL) {
+                e = idx_build(map, size, &nr);
+                if (e == NULL)
+                        return -1;
+                if (idx_save(path, st, e, nr) && nowarn_flag == 0)
+                        fprintf(stderr, "Warning: Failed to write index %s\n",
+                                path);
+        }
+
+        if (!window_flag) {
+                free(e);
+                return process_mapped(ctx, map, size);
+        }
+
+        for (i = 0; i < nr && ret == 0 && !ctx->stop; i++) {
+                if (e[i].off >= size)
+                        break;
+                if (in_window(e[i].sec)) {
+                        if (start < 0)
+                                start = e[i].off;
+                        continue;
+                }
+                if (start >= 0)
+                        ret = process_mapped(ctx, map + start,
+                                             e[i].off - start);
+                start = -1;
+        }
+        if (start >= 0 && ret == 0 && !ctx->stop)
+                ret = process_mapped(ctx, map + start, size - start);
+        free(e);
+        return ret;
+}
+
+/*
+ * Compressed input is piped through the decompressor found by magic, gzip
+ * is inflated in process by zlib, the others by running cmd.
+ */
+static const struct decompressor {
+        const char *magic;
+        int len;
+        const char *cmd;
+} decompressors[] = {
+        { "\x1f\x8b",                   2, NULL },
+        { "\x28\xb5\x2f\xfd",           4, "zstd" },
+        { "\xfd" "7zXZ\0",              6, "xz" },
+        { "BZh",                        3, "bzip2" },
+};
+
+struct input {
+        int fd;                 /* Input file or stdin */
+        char magic[MAGIC_LEN];  /* Bytes peeked from input */
+        int magic_len;
+        int seekable;
+        pid_t pid;              /* Decompressor */
+        int feed_fd;            /* Write end of decompressor stdin */
+        pthread_t feeder;
+        int feeding;
+        int inflating;          /* feeder inflates to feed_fd */
+        int dec_err;
+};
+
+/*
+ * feed_decompressor -- copy the peeked magic and the rest of an input
+ *                      which can not be seeked back to the decompressor.
+ */
+static void *feed_decompressor(void *arg)
+{
+        struct input *in = arg;
+        char *buf;
+        ssize_t n, w, off;
+        sigset_t set;
+
+        /* Decompressor may exit early, get EPIPE instead of signal */
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+        buf = malloc(READ_SIZE);
+        if (buf == NULL)
+                goto out;
+        memcpy(buf, in->magic, in->magic_len);
+        n = in->magic_len;
+        do {
+                for (off = 0; off < n; off += w) {
+                        w = write(in->feed_fd, buf + off, n - off);
+                        if (w < 0 && errno == EINTR)
+                                w = 0;
+                        else if (w < 0)
+                                goto out;
+                }
+                while ((n = read(in->fd, buf, READ_SIZE)) < 0 &&
+                       errno == EINTR)
+                        ;
+        } while (n > 0);
+out:
+        free(buf);
+        close(in->feed_fd);
+        return NULL;
+}
+
+/*
+ * spawn_decompressor -- run "cmd -dc" reads from input, return the read
+ *                       end of its output or -1.
+ */
+static int spawn_decompressor(struct input *in, const char *cmd)
+{
+        int out[2], feed[2] = {-1, -1};
+
+        if (pipe2(out, O_CLOEXEC))
+                return -1;
+        fcntl(out[0], F_SETPIPE_SZ, PIPE_SIZE);
+
+        if (in->seekable) {
+                if (lseek(in->fd, 0, SEEK_SET) < 0)
+                        goto fail;
+        } else if (pipe2(feed, O_CLOEXEC)) {
+                goto fail;
+        }
+
+        in->pid = fork();
+        if (in->pid < 0)
+                goto fail;
+        if (in->pid == 0) {
+                dup2(in->seekable ? in->fd : feed[0], STDIN_FILENO);
+                dup2(out[1], STDOUT_FILENO);
+                execlp(cmd, cmd, "-dc", (char *)NULL);
+                _exit(127);
+        }
+        close(out[1]);
+
+        if (!in->seekable) {
+                close(feed[0]);
+                in->feed_fd = feed[1];
+                in->feeding = !pthread_create(&in->feeder, NULL,
+                                              feed_decompressor, in);
+                if (!in->feeding)
+                        close(feed[1]);
+        }
+        return out[0];
+
+fail:
+        close(out[0]);
+        close(out[1]);
+        if (feed[0] >= 0) {
+                close(feed[0]);
+                close(feed[1]);
+        }
+        return -1;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+        ssize_t w;
+
+        while (len) {
+                w = write(fd, buf, len);
+                if (w < 0 && errno == EINTR)
+                        continue;
+                if (w < 0)
+                        return -1;
+                buf += w;
+                len -= w;
+        }
+        return 0;
+}
+
+/*
+ * inflate_input -- the decode thread of gzip input, inflate the peeked
+ *                  magic and the rest of input to feed_fd. Concatenated
+ *                  gzip members (e.g. by "cat a.gz b.gz") are inflated
+ *                  one by one.
+ */
+static void *inflate_input(void *arg)
+{
+        struct input *in = arg;
+        char *ibuf, *obuf;
+        z_stream zs;
+        sigset_t set;
+        ssize_t n;
+        int zret = Z_OK;
+
+        /* Reader may stop early, get EPIPE instead of signal */
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+        memset(&zs, 0, sizeof(zs));
+        ibuf = malloc(READ_SIZE);
+        obuf = malloc(READ_SIZE);
+        /* 16 + MAX_WBITS: gzip header and trailer */
+        if (ibuf == NULL || obuf == NULL ||
+            inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+                in->dec_err = 1;
+                goto out;
+        }
+
+        memcpy(ibuf, in->magic, in->magic_len);
+        n = in->magic_len;
+        do {
+                zs.next_in = (Bytef *)ibuf;
+                zs.avail_in = n;
+                while (zs.avail_in) {
+                        if (zret == Z_STREAM_END)
+                                inflateReset(&zs);
+                        zs.next_out = (Bytef *)obuf;
+                        zs.avail_out = READ_SIZE;
+                        zret = inflate(&zs, Z_NO_FLUSH);
+                        if (zret != Z_OK && zret != Z_STREAM_END &&
+                            zret != Z_BUF_ERROR) {
+                                in->dec_err = 1;
+                                goto end;
+                        }
+                        if (write_all(in->feed_fd, obuf,
+                                      READ_SIZE - zs.avail_out)) {
+                                in->dec_err = 1;
+                                goto end;
+                        }
+                }
+                while ((n = read(in->fd, ibuf, READ_SIZE)) < 0 &&
+                       errno == EINTR)
+                        ;
+        } while (n > 0);
+        /* Truncated in the middle of a member */
+        if (n < 0 || zret != Z_STREAM_END)
+                in->dec_err = 1;
+end:
+        inflateEnd(&zs);
+out:
+        free(ibuf);
+        free(obuf);
+        close(in->feed_fd);
+        return NULL;
+}
+
+/*
+ * spawn_inflater -- start inflate_input(), return the read end of its
+ *                   output or -1.
+ */
+static int spawn_inflater(struct input *in)
+{
+        int out[2];
+
+        if (pipe2(out, O_CLOEXEC))
+                return -1;
+        fcntl(out[0], F_SETPIPE_SZ, PIPE_SIZE);
+
+        in->feed_fd = out[1];
+        if (pthread_create(&in->feeder, NULL, inflate_input, in)) {
+                close(out[0]);
+                close(out[1]);
+                return -1;
+        }
+        in->feeding = in->inflating = 1;
+        return out[0];
+}
+
+/*
+ * process_one -- aggregate and print one file ("-" for stdin) to ctx->out
+ */
+int process_one(struct m2n_ctx *ctx)
+{
+        struct input in;
+        struct line_reader lr;
+        const struct decompressor *dec = NULL;
+        struct stat st;
+        void *map;
+        int i, fd, status, ret = -1;
+        ssize_t n;
+
+        memset(&in, 0, sizeof(in));
+        memset(&lr, 0, sizeof(lr));
+        in.pid = -1;
+        ctx->stats = calloc(topo.nr_nodes, sizeof(*ctx->stats));
+        if (ctx->stats == NULL || soa_init(&ctx->soa)) {
+                fprintf(stderr, "No memory!\n");
+                soa_free(&ctx->soa);
+                free(ctx->stats);
+                return -1;
+        }
+
+        if (strcmp(ctx->fn, "-") == 0)
+                in.fd = STDIN_FILENO;
+        else
+                in.fd = open(ctx->fn, O_RDONLY | O_CLOEXEC);
+        if (in.fd < 0 || fstat(in.fd, &st)) {
+                if (nowarn_flag == 0)
+                        fprintf(stderr, "Warning: Failed to open file %s\n",
+                                ctx->fn);
+                goto out;
+        }
+        in.seekable = S_ISREG(st.st_mode);
+
+        /* Peek magic, it is kept for the stream of unseekable input */
+        while (in.magic_len < MAGIC_LEN) {
+                n = read(in.fd, in.magic + in.magic_len,
+                         MAGIC_LEN - in.magic_len);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        break;
+                in.magic_len += n;
+        }
+        for (i = 0; i < sizeof(decompressors) / sizeof(*decompressors); i++) {
+                if (in.magic_len >= decompressors[i].len &&
+                    !memcmp(in.magic, decompressors[i].magic,
+                            decompressors[i].len)) {
+                        dec = &decompressors[i];
+                        break;
+                }
+        }
+
+        /* -cpu prints lines as they are read */
+        if (dec || cpu >= 0 || !in.seekable || st.st_size == 0)
+                goto stream;
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in.fd, 0);
+        if (map == MAP_FAILED)
+                goto stream;
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        if (index_flag)
+                ret = process_indexed(ctx, map, &st);
+        else
+                ret = process_mapped(ctx, map, st.st_size);
+        munmap(map, st.st_size);
+        goto done;
+
+stream:
+        fd = in.fd;
+        if (dec) {
+                fd = dec->cmd ? spawn_decompressor(&in, dec->cmd) :
+                                spawn_inflater(&in);
+                if (fd < 0)
+                        goto done;
+                ret = lr_init(&lr, fd, NULL, 0);
+        } else if (in.seekable) {
+                ret = lseek(fd, 0, SEEK_SET) < 0 ? -1 : lr_init(&lr, fd, NULL, 0);
+        } else {
+                ret = lr_init(&lr, fd, in.magic, in.magic_len);
+        }
+        if (ret == 0)
+                ret = process_stream(ctx, &lr);
+        free(lr.buf);
+
+        if (dec) {
+                /* Unblock decompressor if it is stopped early */
+                close(fd);
+                if (in.feeding)
+                        pthread_join(in.feeder, NULL);
+                if (in.inflating) {
+                        if (in.dec_err && !ctx->stop)
+                                ret = -1;
+                } else if (waitpid(in.pid, &status, 0) < 0 ||
+                           (!ctx->stop && (!WIFEXITED(status) ||
+                                           WEXITSTATUS(status) != 0))) {
+                        ret = -1;
+                }
+        }
+done:
+        if (ret && nowarn_flag == 0)
+                fprintf(stderr, "Warning: Failed to process file %s\n",
+                        ctx->fn);
+        /* Print the last interval of file */
+        if (ret == 0 && cpu < 0 && !ctx->stop && ctx->first)
+                print_numa_stat(ctx);
+        if (ret == 0 && !ctx->stop) {
+                resample_flush(ctx);
+                summary_print(ctx);
+        }
+        summary_free(ctx);
+        bin_flush(ctx);
+        bin_free(ctx);
+out:
+        if (in.fd > STDIN_FILENO)
+                close(in.fd);
+        soa_free(&ctx->soa);
+        free(ctx->rs);
+        ctx->rs = NULL;
+        free(ctx->stats);
+        ctx->stats = NULL;
+        return ret;
+}
+
+/*
+ * The file pool, workers take the next file and render it to memory,
+ * main thread prints the outputs in command line order. Workers don't
+ * run more than 2 * nr_jobs files ahead to bound the buffered output.
+ */
+struct file_pool {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        struct m2n_ctx *ctxs;
+        char *done;
+        int next;               /* Next file to be taken by worker */
+        int printed;            /* Files printed by main thread */
+        int nr_files;
+        int abort;              /* Stop taking files */
+};
+
+static void *file_worker(void *arg)
+{
+        struct file_pool *pool = arg;
+        struct m2n_ctx *ctx;
+        int i;
+
+        for (;;) {
+                pthread_mutex_lock(&pool->lock);
+                while (!pool->abort && pool->next < pool->nr_files &&
+                       pool->next >= pool->printed + 2 * nr_jobs)
+                        pthread_cond_wait(&pool->cond, &pool->lock);
+                i = pool->abort ? pool->nr_files : pool->next++;
+                pthread_mutex_unlock(&pool->lock);
+                if (i >= pool->nr_files)
+                        break;
+
+                ctx = &pool->ctxs[i];
+                ctx->out = open_memstream(&ctx->buf, &ctx->buf_len);
+                if (ctx->out == NULL) {
+                        fprintf(stderr, "No memory!\n");
+                        ctx->ret = -1;
+                } else {
+                        ctx->ret = process_one(ctx);
+                        fclose(ctx->out);
+                }
+
+                pthread_mutex_lock(&pool->lock);
+                pool->done[i] = 1;
+                pthread_cond_broadcast(&pool->cond);
+                pthread_mutex_unlock(&pool->lock);
+        }
+        return NULL;
+}
+
+/*
+ * process_files -- process files by the pool, return number of failed
+ */
+int process_files(char **files, int nr_files)
+{
+        struct file_pool pool;
+        pthread_t *threads;
+        int i, j, nr_threads, bad = 0, stop = 0;
+
+        memset(&pool, 0, sizeof(pool));
+        pool.ctxs = calloc(nr_files, sizeof(*pool.ctxs));
+        pool.done = calloc(nr_files, 1);
+        nr_threads = nr_jobs < nr_files ? nr_jobs : nr_files;
+        threads = calloc(nr_threads, sizeof(*threads));
+        if (pool.ctxs == NULL || pool.done == NULL || threads == NULL) {
+                fprintf(stderr, "No memory!\n");
+                exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.cond, NULL);
+        pool.nr_files = nr_files;
+        for (i = 0; i < nr_files; i++) {
+                pool.ctxs[i].fn = files[i];
+                pool.ctxs[i].nr_jobs = 1;
+        }
+
+        for (i = 0; i < nr_threads; i++) {
+                if (pthread_create(&threads[i], NULL, file_worker, &pool)) {
+                        fprintf(stderr, "Failed to create worker!\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        for (i = 0; i < nr_files; i++) {
+                pthread_mutex_lock(&pool.lock);
+                while (!pool.done[i])
+                        pthread_cond_wait(&pool.cond, &pool.lock);
+                pthread_mutex_unlock(&pool.lock);
+
+                if (pool.ctxs[i].buf)
+                        fwrite(pool.ctxs[i].buf, 1, pool.ctxs[i].buf_len,
+                               bin_fp ? bin_fp : stdout);
+                free(pool.ctxs[i].buf);
+                if (pool.ctxs[i].ret)
+                        bad++;
+                if (pool.ctxs[i].stop)
+                        stop = 1;
+
+                pthread_mutex_lock(&pool.lock);
+                pool.printed++;
+                /* Workers waiting for room would wait forever */
+                if (stop)
+                        pool.abort = 1;
+                pthread_cond_broadcast(&pool.cond);
+                pthread_mutex_unlock(&pool.lock);
+                if (stop)
+                        break;
+        }
+
+        for (j = 0; j < nr_threads; j++)
+                pthread_join(threads[j], NULL);
+        /* Rendered but not printed after a stop */
+        while (++i < nr_files)
+                free(pool.ctxs[i].buf);
+        free(threads);
+        free(pool.done);
+        free(pool.ctxs);
+        if (stop)
+                exit(0);
+        return bad;
+}
 
 /*
- * CPU Topology:
- *
- * NUMA node0 CPU(s):     0-27,224-251
- * NUMA node1 CPU(s):     28-55,252-279
- * NUMA node2 CPU(s):     56-83,280-307
- * NUMA node3 CPU(s):     84-111,308-335
- * NUMA node4 CPU(s):     112-139,336-363
- * NUMA node5 CPU(s):     140-167,364-391
- * NUMA node6 CPU(s):     168-195,392-419
- * NUMA node7 CPU(s):     196-223,420-447
- */
-#define NR_CORE 28
-#define NR_NODE 8
-#define NR_THREAD 2
-#define NR_CPU_THREAD (NR_CORE * NR_THREAD)
-#define CPU2NUMA(cpu) (((cpu) / NR_CORE) % NR_NODE)
+ * bin_open -- create the binary output and write the file header
+ */
+static FILE *bin_open(const char *fn)
+{
+        struct bin_header h;
+        char name[8];
+        uint32_t n;
+        FILE *fp;
+        int i;
 
-#ifndef PATH_MAX
-#define PATH_MAX        80
-#endif
+        fp = fopen(fn, "w");
+        if (fp == NULL)
+                return NULL;
+        setvbuf(fp, NULL, _IOFBF, BIN_BUF_SIZE);
 
-#define NR_HLINES       20      /* print header after print data lines */
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, BIN_MAGIC, sizeof(BIN_MAGIC));
+        h.nr_nodes = topo.nr_nodes;
+        h.nr_fields = NR_FIELDS;
+        h.time_len = BIN_TIME_LEN;
+        fwrite(&h, sizeof(h), 1, fp);
+        for (i = 0; i < topo.nr_nodes; i++) {
+                n = topo.node_cpus[i];
+                fwrite(&n, sizeof(n), 1, fp);
+        }
+        for (i = 0; i < NR_FIELDS; i++) {
+                memset(name, 0, sizeof(name));
+                memcpy(name, fields[i].name, strlen(fields[i].name));
+                fwrite(name, sizeof(name), 1, fp);
+        }
+        return fp;
+}
 
-#define MPSTAT_HEAD_GNICE "CPU    %usr   %nice    %sys %iowait    %irq   %soft  %steal  %guest  %gnice   %idle"
-#define MPSTAT_HEAD "CPU    %usr   %nice    %sys %iowait    %irq   %soft  %steal  %guest   %idle"
+/*
+ * dump_one -- print binary output of -bin as text, topology of the dump
+ *             is taken from its header.
+ */
+int dump_one(const char *fn)
+{
+        struct m2n_ctx ctx;
+        struct bin_header h;
+        struct bin_block_header bh;
+        struct bin_block *b = NULL;
+        char name[8];
+        uint32_t n;
+        FILE *fp;
+        int i, f, r, ret = -1;
 
-#define MPSTAT_SCAN_FMT_GNICE   "%s %d %f %f %f %f %f %f %f %f %f %f\n"
-#define MPSTAT_SCAN_FMT         "%s %d %f %f %f %f %f %f %f %f %f\n"
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.fn = fn;
+        ctx.out = stdout;
+        ctx.first = 1;          /* Rows are complete intervals */
+        fp = fopen(fn, "r");
+        if (fp == NULL) {
+                if (nowarn_flag == 0)
+                        fprintf(stderr, "Warning: Failed to open file %s\n", fn);
+                return -1;
+        }
+        setvbuf(fp, NULL, _IOFBF, BIN_BUF_SIZE);
 
-char *prog;
+        if (fread(&h, sizeof(h), 1, fp) != 1 ||
+            memcmp(h.magic, BIN_MAGIC, sizeof(BIN_MAGIC)) ||
+            h.nr_fields != NR_FIELDS || h.time_len != BIN_TIME_LEN ||
+            h.nr_nodes == 0 || h.nr_nodes > 65536)
+                goto out;
 
-int gnice = 0;                  /* Has gnice? */
-int usr_flag = 0;               /* print %usr only */
-int nice_flag = 0;              /* print %nice only */
-int sys_flag = 0;               /* print %sys only */
-int iowait_flag = 0;            /* print %iowait only */
-int irq_flag = 0;               /* print %irq only */
-int soft_flag = 0;              /* print %soft only */
-int steal_flag = 0;             /* print %steal only */
-int guest_flag = 0;             /* print %guest only */
-int gnice_flag = 0;             /* print %gnice only */
-int idle_flag = 0;              /* print %idle only */
-int util_flag = 0;              /* print 100 - idle */
-int print_all = 1;              /* print all nodes stat */
-int header_flag = 1;            /* print header or no? */
-int nowarn_flag = 0;            /* print warn on error? */
-int print_fields = 0;           /* number fields to be printed */
-int node = -1;                  /* The node to print the stat */
-int cpu = -1;                   /* CPU list to print stat */
+        free(topo.node_cpus);
+        topo.node_cpus = calloc(h.nr_nodes, sizeof(int));
+        topo.nr_nodes = h.nr_nodes;
+        if (topo.node_cpus == NULL)
+                goto out;
+        for (i = 0; i < topo.nr_nodes; i++) {
+                if (fread(&n, sizeof(n), 1, fp) != 1)
+                        goto out;
+                topo.node_cpus[i] = n;
+        }
+        for (i = 0; i < NR_FIELDS; i++) {
+                if (fread(name, sizeof(name), 1, fp) != 1 ||
+                    strncmp(name, fields[i].name, sizeof(name)))
+                        goto out;
+        }
 
-int max_files = 0;
+        ctx.stats = calloc(topo.nr_nodes, sizeof(*ctx.stats));
+        b = bin_alloc();
+        if (ctx.stats == NULL || b == NULL)
+                goto out;
 
-struct numa_stat {
-        unsigned int cpu;
-        char time[32];
-        float usr;
-        float nice;
-        float sys;
-        float iowait;
-        float irq;
-        float soft;
-        float steal;
-        float guest;
-        float gnice;
-        float idle;
-};
+        while (fread(&bh, sizeof(bh), 1, fp) == 1) {
+                if (bh.magic != BIN_BLOCK_MAGIC || bh.nr_rows > BIN_BLOCK_ROWS)
+                        goto out;
+                if (fread(b->time, BIN_TIME_LEN, bh.nr_rows, fp) != bh.nr_rows ||
+                    fread(b->node, sizeof(*b->node), bh.nr_rows, fp) != bh.nr_rows)
+                        goto out;
+                for (f = 0; f < NR_FIELDS; f++) {
+                        if (fread(b->col[f], sizeof(int64_t), bh.nr_rows, fp) !=
+                            bh.nr_rows)
+                                goto out;
+                }
+
+                /* Each input file had its own header counters */
+                if (bh.flags & BLK_FIRST) {
+                        resample_flush(&ctx);
+                        ctx.print_lines = 0;
+                }
+                ctx.gnice = !!(bh.flags & BLK_GNICE);
+
+                for (r = 0; r < bh.nr_rows; r++) {
+                        i = b->node[r];
+                        if (i >= topo.nr_nodes)
+                                goto out;
+                        memcpy(ctx.stats[i].time, b->time[r], BIN_TIME_LEN);
+                        for (f = 0; f < NR_FIELDS; f++)
+                                FIELD(&ctx.stats[i], f) = b->col[f][r];
+                        if (i != topo.nr_nodes - 1)
+                                continue;
+                        print_numa_stat(&ctx);
+                        if (ctx.stop)
+                                exit(0);
+                }
+        }
+        ret = ferror(fp) ? -1 : 0;
+        if (ret == 0) {
+                resample_flush(&ctx);
+                summary_print(&ctx);
+        }
+
+out:
+        if (ret && nowarn_flag == 0)
+                fprintf(stderr, "Warning: Invalid binary file %s\n", fn);
+        summary_free(&ctx);
+        ctx.bin = b;
+        bin_free(&ctx);
+        free(ctx.rs);
+        free(ctx.stats);
+        fclose(fp);
+        return ret;
+}
+
+/*
+ * Live mode samples /proc/stat, the per CPU jiffies are in the order of
+ * /proc/stat: user nice system idle iowait irq softirq steal guest
+ * guest_nice.
+ */
+enum { J_USER, J_NICE, J_SYS, J_IDLE, J_IOWAIT, J_IRQ, J_SOFT, J_STEAL,
+       J_GUEST, J_GNICE, NR_JIFFIES };
 
-struct numa_stat stats[NR_NODE];
+struct cpu_jiffies {
+        unsigned long long v[NR_JIFFIES];
+        int online;
+};
 
-void print_stat_multi(struct numa_stat s[NR_NODE])
+/*
+ * read_proc_stat -- pread /proc/stat and fill jiffies of cpus covered by
+ *                   topology.
+ */
+static int read_proc_stat(int fd, char **buf, size_t *size,
+                          struct cpu_jiffies *cj)
 {
-        int i;
-        static int print_lines = 0;
+        char *p, *end;
+        ssize_t n;
+        int c, i;
 
-#define printf_field(f) fprintf(stdout, "%8s", f)
-        if (header_flag && print_lines % NR_HLINES == 0) {
-                fprintf(stdout, "\n%-13s%4s", "TIME", "NODE");
-                if (print_all || usr_flag)      printf_field("%usr");
-                if (print_all || nice_flag)     printf_field("%nice");
-                if (print_all || sys_flag)      printf_field("%sys");
-                if (print_all || iowait_flag)   printf_field("iowait");
-                if (print_all || irq_flag)      printf_field("%irq");
-                if (print_all || soft_flag)     printf_field("%soft");
-                if (print_all || steal_flag)    printf_field("%steal");
-                if (print_all || guest_flag)    printf_field("%guest");
-                if (gnice && (print_all || gnice_flag)) printf_field("%gnice");
-                if (print_all || idle_flag)     printf_field("%idle");
-                if (util_flag)                  printf_field("%util");
-                fprintf(stdout, "\n");
+        /* Grow the buffer until the whole file fits */
+        for (;;) {
+                n = pread(fd, *buf, *size, 0);
+                if (n < 0)
+                        return -1;
+                if ((size_t)n < *size)
+                        break;
+                p = realloc(*buf, *size * 2);
+                if (p == NULL)
+                        return -1;
+                *buf = p;
+                *size *= 2;
         }
 
-#define printf_value(member) fprintf(stdout, "%8.2f", (&s[i])->member / NR_CPU_THREAD)
+        for (c = 0; c < topo.nr_cpus; c++)
+                cj[c].online = 0;
 
-        for (i = 0; i < NR_NODE; i++) {
-                if (node != -1 && i != node) continue;
-                print_lines++;
-                fprintf(stdout, "%-13s%4d", s[i].time, i);
-                if (print_all || usr_flag)      printf_value(usr);
-                if (print_all || nice_flag)     printf_value(nice);
-                if (print_all || sys_flag)      printf_value(sys);
-                if (print_all || iowait_flag)   printf_value(iowait);
-                if (print_all || irq_flag)      printf_value(irq);
-                if (print_all || soft_flag)     printf_value(soft);
-                if (print_all || steal_flag)    printf_value(steal);
-                if (print_all || guest_flag)    printf_value(guest);
-                if (gnice && (print_all || gnice_flag)) printf_value(gnice);
-                if (print_all || idle_flag)     printf_value(idle);
-                if (util_flag)
-                        fprintf(stdout, "%8.2f",
-                                (100.00 - s[i].idle / NR_CPU_THREAD));
+        for (p = *buf, end = *buf + n; p < end; p++) {
+                /* "cpuN ...", the cpu lines are at head of file */
+                if (end - p < 4 || memcmp(p, "cpu", 3))
+                        break;
+                p += 3;
+                if (!is_digit(*p)) {
+                        p = memchr(p, '\n', end - p);
+                        if (p == NULL)
+                                break;
+                        continue;
+                }
+                for (c = 0; p < end && is_digit(*p); p++)
+                        c = c * 10 + (*p - '0');
+                for (i = 0; i < NR_JIFFIES; i++) {
+                        unsigned long long v = 0;
+
+                        while (p < end && *p == ' ')
+                                p++;
+                        while (p < end && is_digit(*p))
+                                v = v * 10 + (*p++ - '0');
+                        if (c < topo.nr_cpus)
+                                cj[c].v[i] = v;
+                }
+                if (c < topo.nr_cpus)
+                        cj[c].online = 1;
+                p = memchr(p, '\n', end - p);
+                if (p == NULL)
+                        break;
         }
-        if (header_flag)
-                fprintf(stdout, "\n");
-        memset(s, 0, sizeof(stats));
+        return 0;
 }
 
-void print_stat_util(struct numa_stat s[NR_NODE])
+/* Delta of jiffies, a counter may go backwards across CPU hotplug */
+#define JDELTA(j) (cur->v[j] > prev->v[j] ? cur->v[j] - prev->v[j] : 0)
+
+/*
+ * jiffies_to_slot -- convert the delta of one CPU into hundredths of
+ *                    percent the same as mpstat does.
+ */
+static void jiffies_to_slot(const struct cpu_jiffies *cur,
+                            const struct cpu_jiffies *prev,
+                            struct soa *a, int slot)
 {
+        unsigned long long d[NR_JIFFIES], total;
         int i;
-        static int header = 0;
 
-        header++;
-        if (header_flag && header % NR_HLINES == 0) {
-                fprintf(stdout, "\n%-13s", "UTIL_TIME");
-                for (i = 0; i < NR_NODE; i++)
-                        fprintf(stdout, "%6s%02d ", "N", i);
-                fprintf(stdout, "\n");
-        }
-        fprintf(stdout, "%-12s", s[0].time);
-        for (i = 0; i < NR_NODE; i++)
-                fprintf(stdout, "%9.2f",
-                        (100.00 - s[i].idle / NR_CPU_THREAD));
-        fprintf(stdout, "\n");
-        memset(s, 0, sizeof(stats));
-}
+        for (i = 0; i < NR_JIFFIES; i++)
+                d[i] = JDELTA(i);
 
-#define define_print_stat(name, s) \
-  void print_stat_##name(struct numa_stat s[NR_NODE]) {                 \
-        int i;                                                          \
-        static int header = 0;                                          \
-        header++;                                                       \
-        if (header_flag && header % NR_HLINES  == 0) {                  \
-                fprintf(stdout, "\n%-13s", #name"-TIME");               \
-                for (i = 0; i < NR_NODE; i++)                           \
-                        fprintf(stdout, "%6s%02d ", "N", i);            \
-                fprintf(stdout, "\n");                                  \
-        }                                                               \
-        fprintf(stdout, "%-12s", s[0].time);                            \
-        for (i = 0; i < NR_NODE; i++)                                   \
-                fprintf(stdout, "%9.2f", s[i].name / NR_CPU_THREAD);    \
-        fprintf(stdout, "\n");                                          \
-        memset(s, 0, sizeof(stats));                                    \
+        /* user and nice include guest and guest_nice */
+        d[J_USER] = d[J_USER] > d[J_GUEST] ? d[J_USER] - d[J_GUEST] : 0;
+        d[J_NICE] = d[J_NICE] > d[J_GNICE] ? d[J_NICE] - d[J_GNICE] : 0;
+        total = 0;
+        for (i = 0; i < NR_JIFFIES; i++)
+                total += d[i];
+
+#define PCT(j) (total ? (int32_t)((d[j] * 10000 + total / 2) / total) : 0)
+        a->col[0][slot] = PCT(J_USER);
+        a->col[1][slot] = PCT(J_NICE);
+        a->col[2][slot] = PCT(J_SYS);
+        a->col[3][slot] = PCT(J_IOWAIT);
+        a->col[4][slot] = PCT(J_IRQ);
+        a->col[5][slot] = PCT(J_SOFT);
+        a->col[6][slot] = PCT(J_STEAL);
+        a->col[7][slot] = PCT(J_GUEST);
+        a->col[8][slot] = PCT(J_GNICE);
+        a->col[9][slot] = PCT(J_IDLE);
+#undef PCT
 }
 
-define_print_stat(usr, s)
-define_print_stat(nice, s)
-define_print_stat(sys, s)
-define_print_stat(iowait, s)
-define_print_stat(irq, s)
-define_print_stat(soft, s)
-define_print_stat(steal, s)
-define_print_stat(guest, s)
-define_print_stat(idle, s)
-define_print_stat(gnice, s)
+static volatile sig_atomic_t live_stop;
 
-void print_numa_stat(struct numa_stat s[NR_NODE])
+static void live_sig(int sig)
 {
-        static int first = 0;
+        live_stop = 1;
+}
 
-        /* Don't print for first run */
-        if (first == 0) {
-                first++;
-                return;
-        }
+/*
+ * process_live -- sample /proc/stat every live_interval seconds and print
+ *                 node stats, the fd is kept opened and read by pread().
+ *                 With -summary or -bin, SIGINT/SIGTERM end the sampling,
+ *                 the summary is printed and the last block written.
+ */
+int process_live(void)
+{
+        struct sigaction sa;
+        struct m2n_ctx ctx;
+        struct cpu_jiffies *cj[2];
+        struct timespec next, now;
+        struct tm tm;
+        char time[32], *buf;
+        size_t size = 64 << 10;
+        long nsec, n;
+        int fd, c, slot, cur = 0, ret = -1;
 
-        if (print_all || print_fields > 1) {
-                print_stat_multi(s);
-                return;
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.fn = PROC_STAT;
+        ctx.out = bin_fp ? bin_fp : stdout;
+        ctx.gnice = 1;
+        ctx.first = 1;
+        if (summary_flag || bin_fp) {
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = live_sig;
+                sigaction(SIGINT, &sa, NULL);
+                sigaction(SIGTERM, &sa, NULL);
+        }
+        ctx.stats = calloc(topo.nr_nodes, sizeof(*ctx.stats));
+        if (soa_init(&ctx.soa))
+                ctx.stats = NULL;
+        cj[0] = calloc(topo.nr_cpus, sizeof(**cj));
+        cj[1] = calloc(topo.nr_cpus, sizeof(**cj));
+        buf = malloc(size);
+        fd = open(PROC_STAT, O_RDONLY | O_CLOEXEC);
+        if (!ctx.stats || !cj[0] || !cj[1] || !buf || fd < 0 ||
+            read_proc_stat(fd, &buf, &size, cj[cur])) {
+                fprintf(stderr, "Failed to read %s\n", PROC_STAT);
+                goto out;
         }
-#define check_print_and_return(field) do {      \
-        if (field ## _flag) {                   \
-                print_stat_##field(s);          \
-                return;                         \
-        }                                       \
-} while (0)
 
-        check_print_and_return(usr);
-        check_print_and_return(nice);
-        check_print_and_return(sys);
-        check_print_and_return(iowait);
-        check_print_and_return(irq);
-        check_print_and_return(soft);
-        check_print_and_return(steal);
-        check_print_and_return(guest);
-        check_print_and_return(idle);
-        check_print_and_return(util);
-        if (gnice_flag) {
-                if (gnice) {
-                        print_stat_gnice(s);
-                        return;
+        nsec = (long)(live_interval * 1e9);
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        for (n = 0; !live_stop && (live_count == 0 || n < live_count); n++) {
+                next.tv_sec += nsec / 1000000000;
+                next.tv_nsec += nsec % 1000000000;
+                if (next.tv_nsec >= 1000000000) {
+                        next.tv_sec++;
+                        next.tv_nsec -= 1000000000;
                 }
-                fprintf(stdout, "No gnice included by mpstat!\n");
-                exit(0);
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                       &next, NULL) == EINTR && !live_stop)
+                        ;
+                if (live_stop)
+                        break;
+
+                cur = !cur;
+                if (read_proc_stat(fd, &buf, &size, cj[cur])) {
+                        fprintf(stderr, "Failed to read %s\n", PROC_STAT);
+                        goto out;
+                }
+
+                clock_gettime(CLOCK_REALTIME, &now);
+                localtime_r(&now.tv_sec, &tm);
+                c = strftime(time, sizeof(time), "%H:%M:%S", &tm);
+                /* Sub-second interval */
+                if (nsec % 1000000000)
+                        snprintf(time + c, sizeof(time) - c, ".%03ld",
+                                 now.tv_nsec / 1000000);
+                soa_set_time(&ctx.soa, time, strlen(time));
+
+                for (c = 0; c < topo.nr_cpus; c++) {
+                        if ((slot = topo.cpu2slot[c]) < 0 ||
+                            !cj[cur][c].online || !cj[!cur][c].online)
+                                continue;
+                        jiffies_to_slot(&cj[cur][c], &cj[!cur][c],
+                                        &ctx.soa, slot);
+                }
+                soa_reduce(&ctx.soa, ctx.stats);
+                print_numa_stat(&ctx);
+                fflush(stdout);
         }
+        ret = 0;
+        resample_flush(&ctx);
+        summary_print(&ctx);
 
-        return;
+out:
+        summary_free(&ctx);
+        bin_flush(&ctx);
+        bin_free(&ctx);
+        soa_free(&ctx.soa);
+        if (fd >= 0)
+                close(fd);
+        free(buf);
+        free(cj[0]);
+        free(cj[1]);
+        free(ctx.rs);
+        free(ctx.stats);
+        return ret;
 }
 
-void add_numa_stat(struct numa_stat *to, struct numa_stat from)
+/*
+ * parse_line_sscanf -- the old sscanf() based parser, kept as the baseline
+ *                      of -bench.
+ */
+static int parse_line_sscanf(const char *line, struct mpstat_line *ml,
+                             int32_t *row)
 {
-        strncpy(to->time, from.time, 32);
+        char time[32];
+        float v[MAX_VALS];
+        int i, n;
 
-        to->usr += from.usr;
-        to->nice += from.nice;
-        to->sys += from.sys;
-        to->iowait += from.iowait;
-        to->irq += from.irq;
-        to->soft += from.soft;
-        to->steal += from.steal;
-        to->guest += from.guest;
-        to->idle += from.idle;
-        if (gnice)
-                to->gnice += from.gnice;
+        if (strlen(line) < 5)
+                return LINE_SKIP;
+        if (strncmp(line, "Average:", strlen("Average:")) == 0)
+                return LINE_SKIP;
+        if (line[0] != '0' && line[0] != '1' && line[0] != '2')
+                return LINE_SKIP;
+        ml->gnice = strstr(line, "%gnice") != NULL;
+        if (strstr(line, "  all   ") != NULL)
+                return LINE_ALL;
+        if (strstr(line, "CPU    %usr") != NULL)
+                return LINE_HEADER;
+
+        n = sscanf(line, "%31s %d %f %f %f %f %f %f %f %f %f %f\n", time,
+                   &ml->cpu, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+                   &v[6], &v[7], &v[8], &v[9]);
+        if (n < MAX_VALS + 1)
+                return LINE_SKIP;
+        for (i = 0; i < n - 2; i++)
+                row[i] = (int32_t)(v[i] * 100 + 0.5);
+        return LINE_CPU;
 }
 
+static double now_sec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-int process_one(const char *fn)
+/*
+ * bench_reduce -- compare the per line aggregation by add_numa_stat() with
+ *                 soa_add() and soa_reduce() by each sum kernel on a
+ *                 synthetic topology of @nr_cpus CPUs (2 threads per core)
+ *                 and @nr_nodes. Values are parsed from text in both, the
+ *                 best of BENCH_RUNS runs is reported.
+ */
+#define BENCH_RUNS 5
+void bench_reduce(int nr_cpus, int nr_nodes)
 {
+        struct topology saved = topo;
+        long (*saved_sum)(const int32_t *, int) = sum_i32;
+        struct numa_stat *stats, *ref;
+        struct mpstat_line *lines;
+        struct soa a;
+        int32_t row[NR_FIELDS], *col[NR_FIELDS];
+        char list[64], *text, *p;
+        int i, k, r, c, n, f, cpn, len, iters = 2000;
+        double t, base, best, reduce;
 
-        FILE *fp = NULL;
-        char *line = NULL;
-        size_t len = 0;
-        ssize_t read;
-        struct numa_stat tmp_stat;
-        int print_lines = 0;
+        memset(&topo, 0, sizeof(topo));
+        cpn = nr_cpus / 2 / nr_nodes;
+        for (n = 0; n < nr_nodes; n++) {
+                snprintf(list, sizeof(list), "%d-%d,%d-%d", n * cpn,
+                         (n + 1) * cpn - 1, nr_cpus / 2 + n * cpn,
+                         nr_cpus / 2 + (n + 1) * cpn - 1);
+                topo_add_cpulist(n, list);
+        }
+        stats = calloc(nr_nodes, sizeof(*stats));
+        ref = calloc(nr_nodes, sizeof(*ref));
+        lines = calloc(nr_cpus, sizeof(*lines));
+        text = malloc((size_t)nr_cpus * 128);
+        if (topo_build_slots() || stats == NULL || ref == NULL ||
+            lines == NULL || text == NULL || soa_init(&a)) {
+                fprintf(stderr, "No memory!\n");
+                exit(EXIT_FAILURE);
+        }
+        for (f = 0; f < NR_FIELDS; f++)
+                col[f] = &row[f];
+        for (c = 0, p = text; c < nr_cpus; c++, p += 128) {
+                len = snprintf(p, 128, "12:00:00     %4d", c);
+                for (i = 0; i < MAX_VALS; i++) {
+                        k = (c * 7919 + i * 104729) % 10001;
+                        len += snprintf(p + len, 128 - len, " %4d.%02d",
+                                        k / 100, k % 100);
+                }
+                parse_line(p, len, &lines[c]);
+        }
+
+        fprintf(stdout, "reduce %d CPUs %d nodes:\n", nr_cpus, nr_nodes);
+        for (base = 0, r = 0; r < BENCH_RUNS; r++) {
+                t = now_sec();
+                for (k = 0; k < iters; k++) {
+                        memset(ref, 0, nr_nodes * sizeof(*ref));
+                        for (c = 0; c < nr_cpus; c++) {
+                                parse_vals(&lines[c], col, 0);
+                                add_numa_stat(&ref[topo.cpu2node[c]],
+                                              &lines[c], row);
+                        }
+                }
+                t = now_sec() - t;
+                if (r == 0 || t < base)
+                        base = t;
+        }
+        fprintf(stdout, "  add_numa_stat   : %8.0f ns/interval\n",
+                base * 1e9 / iters);
+
+        for (i = 0; i < sizeof(sum_kernels) / sizeof(*sum_kernels); i++) {
+                if (!sum_kernel_supported(&sum_kernels[i]))
+                        continue;
+                sum_i32 = sum_kernels[i].fn;
+                for (best = 0, reduce = 0, r = 0; r < BENCH_RUNS; r++) {
+                        t = now_sec();
+                        for (k = 0; k < iters; k++) {
+                                memset(stats, 0, nr_nodes * sizeof(*stats));
+                                for (c = 0; c < nr_cpus; c++)
+                                        soa_add(&a, topo.cpu2slot[c],
+                                                &lines[c]);
+                                soa_reduce(&a, stats);
+                        }
+                        t = now_sec() - t;
+                        if (r == 0 || t < best)
+                                best = t;
+
+                        /* Reduce only, columns are cleared by reduce */
+                        t = now_sec();
+                        for (k = 0; k < iters; k++) {
+                                memset(stats, 0, nr_nodes * sizeof(*stats));
+                                a.has_time = 1;
+                                soa_reduce(&a, stats);
+                        }
+                        t = now_sec() - t;
+                        if (r == 0 || t < reduce)
+                                reduce = t;
+                }
+                /* Check the last result of store+reduce */
+                memset(stats, 0, nr_nodes * sizeof(*stats));
+                for (c = 0; c < nr_cpus; c++)
+                        soa_add(&a, topo.cpu2slot[c], &lines[c]);
+                soa_reduce(&a, stats);
+                fprintf(stdout, "  soa %-11s : %8.0f ns/interval (%.2fx), "
+                        "reduce %6.0f ns%s\n", sum_kernels[i].name,
+                        best * 1e9 / iters, base / best,
+                        reduce * 1e9 / iters,
+                        memcmp(stats, ref, nr_nodes * sizeof(*ref)) ?
+                        " MISMATCH" : "");
+        }
+
+        soa_free(&a);
+        free(text);
+        free(lines);
+        free(ref);
+        free(stats);
+        free(topo.cpu2node);
+        free(topo.node_cpus);
+        free(topo.cpu2slot);
+        free(topo.node_off);
+        topo = saved;
+        sum_i32 = saved_sum;
+}
 
+/*
+ * bench_one -- compare lines/sec of parse_line() and the sscanf() parser,
+ *              the file is loaded to memory first so no I/O is counted.
+ */
+int bench_one(const char *fn)
+{
+        FILE *fp;
+        char *buf, *cbuf, *p, *end, *nl;
+        long size, lines = 0, cpu_lines[2] = {0, 0};
+        struct mpstat_line ml;
+        int32_t row[NR_FIELDS], *col[NR_FIELDS];
+        double t, elapsed[2];
+        int f;
+
+        for (f = 0; f < NR_FIELDS; f++)
+                col[f] = &row[f];
 
         fp = fopen(fn, "r");
         if (fp == NULL) {
@@ -258,76 +2873,58 @@ int process_one(const char *fn)
                         fprintf(stderr, "Warning: Failed to open file %s\n", fn);
                 return -1;
         }
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        rewind(fp);
+        buf = malloc(size + 1);
+        cbuf = malloc(size + 1);
+        if (buf == NULL || cbuf == NULL ||
+            fread(buf, 1, size, fp) != (size_t)size) {
+                fprintf(stderr, "Warning: Failed to read file %s\n", fn);
+                free(buf);
+                free(cbuf);
+                fclose(fp);
+                return -1;
+        }
+        fclose(fp);
+        buf[size] = '\0';
 
-        while ((read = getline(&line, &len, fp)) != -1) {
-                /* Empty line */
-                if (strlen(line) < 5)   /* Empty line? */
-                        continue;
-
-                /* Average line, skip */
-                if (strncmp(line, "Average:", strlen("Average:")) == 0)
-                        continue;
-
-                /* Not start with time */
-                if (line[0] != '0' && line[0] != '1' && line[0] != '2')
-                        continue;
-
-                /* output include gnice? */
-                if (strstr(line, "%gnice") != NULL)
-                        gnice = 1;
+        /* sscanf() needs C string, terminate lines as getline() did */
+        memcpy(cbuf, buf, size + 1);
+        for (p = cbuf, end = cbuf + size; p < end; p = nl + 1) {
+                nl = memchr(p, '\n', end - p);
+                if (nl == NULL)
+                        break;
+                *nl = '\0';
+        }
 
-                if (strstr(line, "  all   ") != NULL)
-                        continue;
+        t = now_sec();
+        for (p = cbuf, end = cbuf + size; p < end; p += strlen(p) + 1) {
+                lines++;
+                if (parse_line_sscanf(p, &ml, row) == LINE_CPU)
+                        cpu_lines[0]++;
+        }
+        elapsed[0] = now_sec() - t;
 
-                if (strstr(line, (gnice ? MPSTAT_HEAD_GNICE : MPSTAT_HEAD))
-                    != NULL) {
-                        /* Only want to get given CPU stat */
-                        if (cpu >= 0) {
-                                if (header_flag == 1 &&
-                                    print_lines % NR_HLINES == 0)
-                                        fprintf(stdout, "\n%s", line);
-                                continue;
-                        }
-                        print_numa_stat(stats);
-                }
-
-                memset(&tmp_stat, 0, sizeof(tmp_stat));
-                if (gnice)
-                        sscanf(line, MPSTAT_SCAN_FMT_GNICE,
-                               tmp_stat.time,
-                               &tmp_stat.cpu,
-                               &tmp_stat.usr,
-                               &tmp_stat.nice,
-                               &tmp_stat.sys,
-                               &tmp_stat.iowait,
-                               &tmp_stat.irq,
-                               &tmp_stat.soft,
-                               &tmp_stat.steal,
-                               &tmp_stat.guest,
-                               &tmp_stat.gnice, &tmp_stat.idle);
-                else
-                        sscanf(line, MPSTAT_SCAN_FMT,
-                               tmp_stat.time,
-                               &tmp_stat.cpu,
-                               &tmp_stat.usr,
-                               &tmp_stat.nice,
-                               &tmp_stat.sys,
-                               &tmp_stat.iowait,
-                               &tmp_stat.irq,
-                               &tmp_stat.soft,
-                               &tmp_stat.steal,
-                               &tmp_stat.guest, &tmp_stat.idle);
-                if (cpu != -1 && tmp_stat.cpu == cpu) {
-                        print_lines++;
-                        fprintf(stdout, "%s", line);
-                        continue;
-                }
-                add_numa_stat(&stats[CPU2NUMA(tmp_stat.cpu)], tmp_stat);
+        t = now_sec();
+        for (p = buf, end = buf + size; p < end; p = nl + 1) {
+                nl = memchr(p, '\n', end - p);
+                if (nl == NULL)
+                        nl = end;
+                if (parse_line(p, nl - p, &ml) == LINE_CPU &&
+                    parse_vals(&ml, col, 0) == 0)
+                        cpu_lines[1]++;
         }
+        elapsed[1] = now_sec() - t;
 
-        free(line);
-        fclose(fp);
+        fprintf(stdout, "%s: %ld lines, %ld/%ld CPU lines\n", fn, lines,
+                cpu_lines[0], cpu_lines[1]);
+        fprintf(stdout, "  sscanf     : %10.0f lines/s\n", lines / elapsed[0]);
+        fprintf(stdout, "  parse_line : %10.0f lines/s (%.1fx)\n",
+                lines / elapsed[1], elapsed[0] / elapsed[1]);
 
+        free(buf);
+        free(cbuf);
         return 0;
 }
 
@@ -345,8 +2942,13 @@ void usage_and_exit(char *prog, int exit_code, const char *fmt, ...)
         fprintf(stderr, "%s --  Convert mpstat out to NUMA node workload\n\n",
                          prog);
         fprintf(stderr, "Usage: %s -noheader -nowarn -usr -nice -sys"
-                        " -iowait -irq -soft -steal -guest -idle -util"
-                        " file1 file2 ...\n\n", prog);
+                        " -iowait -irq -soft -steal -guest -idle -util -j n -bench"
+                        " -live interval [count] -bin file -dump -summary"
+                        " -from hh:mm:ss -to hh:mm:ss -resample n -index"
+                        " -topo lscpu_file file1 file2 ...\n\n", prog);
+        fprintf(stderr, "       file      : mpstat -P ALL output, \"-\" for stdin,\n"
+                        "                   gzip/zstd/xz/bzip2 compressed is detected\n"
+                        "                   and decompressed on the fly, gzip by zlib\n");
         fprintf(stderr, "       -noheader : Don't print header\n");
         fprintf(stderr, "       -nowarn   : Don't print warning message\n");
         fprintf(stderr, "       -help|-h  : Print this help\n");
@@ -362,6 +2964,26 @@ void usage_and_exit(char *prog, int exit_code, const char *fmt, ...)
         fprintf(stderr, "       -util     : print %%(100-idle) of all nodes\n");
         fprintf(stderr, "       -node n   : print given node stat only\n");
         fprintf(stderr, "       -cpu n    : print given cpu only\n");
+        fprintf(stderr, "       -live i [c]: sample " PROC_STAT " every i seconds (may be\n"
+                        "                   fractional) c times, default: endless\n");
+        fprintf(stderr, "       -bin f    : write binary columnar output to f\n");
+        fprintf(stderr, "       -dump     : inputs are -bin output, print them as text\n");
+        fprintf(stderr, "       -summary  : print mean/p50/p95/p99/max of the fields per\n"
+                        "                   node, the hottest node and the node imbalance\n"
+                        "                   of each input instead of every interval\n");
+        fprintf(stderr, "       -from t   : skip intervals before time of day t (hh:mm[:ss])\n");
+        fprintf(stderr, "       -to t     : skip intervals after t, the window wraps\n"
+                        "                   midnight if -from is later than -to\n");
+        fprintf(stderr, "       -resample n: print average of every n intervals\n");
+        fprintf(stderr, "       -index    : use file" IDX_SUFFIX " to seek to -from/-to\n"
+                        "                   window, it is built if missing or stale\n");
+        fprintf(stderr, "       -j n      : number of worker threads, default: online CPUs.\n"
+                        "                   files are processed in parallel if more\n"
+                        "                   than one given, otherwise chunks of file.\n");
+        fprintf(stderr, "       -bench    : compare line parser with sscanf() and node\n"
+                        "                   reduction kernels with add_numa_stat()\n");
+        fprintf(stderr, "       -topo f   : read NUMA topology from lscpu output f,\n"
+                        "                   default: " SYSFS_NODE_PATH "\n");
         fprintf(stderr, "\n\n");
 
         exit(exit_code);
@@ -389,10 +3011,14 @@ int validate_number(const char *s, int min, int max)
 
 int main(int argc, char **argv)
 {
-        int i, good, bad;
-        char **files;
+        int i, n, good, bad;
+        char **files, *end;
 
         prog = basename(argv[0]);
+        simd_init();
+        nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nr_jobs < 1)
+                nr_jobs = 1;
 
         error_exit((argc < 2), EXIT_FAILURE,
                    "%s: not enough arguments", prog);
@@ -428,6 +3054,11 @@ int main(int argc, char **argv)
                         continue;
                 }
 
+                if (strcmp(argv[i], "-bench") == 0) {
+                        bench_flag = 1;
+                        continue;
+                }
+
                 if (strcmp(argv[i], "-nowarn") == 0) {
                         nowarn_flag = 0;
                         continue;
@@ -437,10 +3068,9 @@ int main(int argc, char **argv)
                         error_exit(argc < i + 2, EXIT_FAILURE,
                                    "[ERROR]: No node given\n\n");
                         i++;
-                        node = validate_number(argv[i], 0, NR_NODE - 1);
+                        node = validate_number(argv[i], 0, INT_MAX);
                         error_exit(node < 0, EXIT_FAILURE,
-                                  "[ERROR]: Invalid Node %s, range: [0-%d]\n\n",
-                                  argv[i], NR_NODE - 1);
+                                  "[ERROR]: Invalid Node %s\n\n", argv[i]);
                         continue;
                 }
 
@@ -449,10 +3079,98 @@ int main(int argc, char **argv)
                                    "[ERROR]: No cpu given!\n\n");
 
                         i++;
-                        cpu = validate_number(argv[i], 0, NR_NODE * NR_CPU_THREAD - 1);
+                        cpu = validate_number(argv[i], 0, INT_MAX);
                         error_exit(cpu < 0, EXIT_FAILURE,
-                                   "[ERROR]: Invalid cpu %s, range: [0-%d]\n\n",
-                                   argv[i], NR_NODE * NR_CPU_THREAD - 1);
+                                   "[ERROR]: Invalid cpu %s\n\n", argv[i]);
+                        continue;
+                }
+
+                if (strcmp(argv[i], "-live") == 0) {
+                        error_exit(argc < i + 2, EXIT_FAILURE,
+                                   "[ERROR]: No interval given!\n\n");
+                        i++;
+                        live_interval = strtod(argv[i], &end);
+                        error_exit(*end || live_interval < 0.001 ||
+                                   live_interval > 86400, EXIT_FAILURE,
+                                   "[ERROR]: Invalid interval %s\n\n",
+                                   argv[i]);
+                        if (i + 1 < argc && argv[i + 1][0] != '-') {
+                                i++;
+                                live_count = validate_number(argv[i], 1,
+                                                             INT_MAX);
+                                error_exit(live_count < 0, EXIT_FAILURE,
+                                           "[ERROR]: Invalid count %s\n\n",
+                                           argv[i]);
+                        }
+                        continue;
+                }
+
+                if (strcmp(argv[i], "-bin") == 0) {
+                        error_exit(argc < i + 2, EXIT_FAILURE,
+                                   "[ERROR]: No binary output file given!\n\n");
+                        bin_file = argv[++i];
+                        continue;
+                }
+
+                if (strcmp(argv[i], "-dump") == 0) {
+                        dump_flag = 1;
+                        continue;
+                }
+
+                if (strcmp(argv[i], "-summary") == 0) {
+                        summary_flag = 1;
+                        continue;
+                }
+
+                if (strcmp(argv[i], "-from") == 0 ||
+                    strcmp(argv[i], "-to") == 0) {
+                        error_exit(argc < i + 2, EXIT_FAILURE,
+                                   "[ERROR]: No time given for %s!\n\n",
+                                   argv[i]);
+                        n = parse_time(argv[i + 1]);
+                        error_exit(n < 0, EXIT_FAILURE,
+                                   "[ERROR]: Invalid time %s, format: "
+                                   "hh:mm[:ss]\n\n", argv[i + 1]);
+                        if (argv[i][1] == 'f')
+                                from_sec = n;
+                        else
+                                to_sec = n;
+                        window_flag = 1;
+                        i++;
+                        continue;
+                }
+
+                if (strcmp(argv[i], "-resample") == 0) {
+                        error_exit(argc < i + 2, EXIT_FAILURE,
+                                   "[ERROR]: No number of intervals given!\n\n");
+                        i++;
+                        resample = validate_number(argv[i], 1, INT_MAX);
+                        error_exit(resample < 0, EXIT_FAILURE,
+                                   "[ERROR]: Invalid intervals %s\n\n",
+                                   argv[i]);
+                        continue;
+                }
+
+                if (strcmp(argv[i], "-index") == 0) {
+                        index_flag = 1;
+                        continue;
+                }
+
+                if (strcmp(argv[i], "-j") == 0) {
+                        error_exit(argc < i + 2, EXIT_FAILURE,
+                                   "[ERROR]: No number of jobs given!\n\n");
+                        i++;
+                        nr_jobs = validate_number(argv[i], 1, 1024);
+                        error_exit(nr_jobs < 0, EXIT_FAILURE,
+                                   "[ERROR]: Invalid jobs %s, range: [1-1024]\n\n",
+                                   argv[i]);
+                        continue;
+                }
+
+                if (strcmp(argv[i], "-topo") == 0) {
+                        error_exit(argc < i + 2, EXIT_FAILURE,
+                                   "[ERROR]: No topology file given!\n\n");
+                        topo_file = argv[++i];
                         continue;
                 }
 
@@ -470,23 +3188,95 @@ int main(int argc, char **argv)
                 strncpy(files[max_files], argv[i], PATH_MAX - 1);
                 max_files++;
         }
-        error_exit(max_files == 0, EXIT_FAILURE, "ERROR: No input file!\n\n");
+        error_exit(max_files == 0 && live_interval == 0 && !bench_flag,
+                   EXIT_FAILURE,
+                   "ERROR: No input file!\n\n");
+        error_exit(max_files && live_interval, EXIT_FAILURE,
+                   "ERROR: -live does not take input file!\n\n");
+        error_exit(live_interval && cpu >= 0, EXIT_FAILURE,
+                   "ERROR: -cpu is not supported by -live!\n\n");
+
+        error_exit(dump_flag && (bin_file || live_interval || bench_flag),
+                   EXIT_FAILURE, "ERROR: -dump only prints -bin output!\n\n");
+        error_exit(bin_file && cpu >= 0, EXIT_FAILURE,
+                   "ERROR: -cpu is not supported by -bin!\n\n");
+        error_exit(summary_flag && (bin_file || cpu >= 0), EXIT_FAILURE,
+                   "ERROR: -summary does not support -bin or -cpu!\n\n");
+        error_exit(cpu >= 0 && (window_flag || resample > 1), EXIT_FAILURE,
+                   "ERROR: -cpu does not support -from/-to/-resample!\n\n");
+
+        /* Topology of dump is saved in the binary file */
+        if (dump_flag) {
+                bad = 0;
+                for (i = 0; i < max_files; i++) {
+                        if (dump_one(files[i]))
+                                bad++;
+                }
+                return bad ? EXIT_FAILURE : 0;
+        }
+
+        error_exit(load_topology(), EXIT_FAILURE,
+                   "[ERROR]: Failed to load NUMA topology from %s\n\n",
+                   topo_file ? topo_file : SYSFS_NODE_PATH);
+        error_exit(node >= topo.nr_nodes, EXIT_FAILURE,
+                   "[ERROR]: Invalid Node %d, range: [0-%d]\n\n",
+                   node, topo.nr_nodes - 1);
+        error_exit(cpu >= topo.nr_cpus, EXIT_FAILURE,
+                   "[ERROR]: Invalid cpu %d, range: [0-%d]\n\n",
+                   cpu, topo.nr_cpus - 1);
 
         if (header_flag) {
                 fprintf(stdout, "-----------------------------\n");
-                fprintf(stdout, "Thread(s) per core : %d\n", NR_THREAD);
-                fprintf(stdout, "NUMA node(s)       : %d\n", NR_NODE);
-                fprintf(stdout, "Core(s) per socket : %d\n", NR_CORE);
+                fprintf(stdout, "CPU(s)             : %d\n", topo.nr_cpus);
+                fprintf(stdout, "NUMA node(s)       : %d\n", topo.nr_nodes);
+                fprintf(stdout, "Topology           : %s\n",
+                                topo_file ? topo_file : SYSFS_NODE_PATH);
                 fprintf(stdout, "-----------------------------\n\n");
         }
 
+        if (bin_file) {
+                bin_fp = bin_open(bin_file);
+                error_exit(bin_fp == NULL, EXIT_FAILURE,
+                           "[ERROR]: Failed to create %s\n\n", bin_file);
+        }
+
+        if (live_interval) {
+                i = process_live();
+                if (bin_fp && fclose(bin_fp))
+                        i = -1;
+                return i ? EXIT_FAILURE : 0;
+        }
+
         good = bad = 0;
-        for (i = 0; i < max_files; i++) {
-                if (process_one(files[i]))
-                        bad++;
-                else
-                        good++;
+        if (bench_flag) {
+                bench_reduce(448, 8);
+                bench_reduce(1024, 16);
+                for (i = 0; i < max_files; i++) {
+                        if (bench_one(files[i]))
+                                bad++;
+                }
+        } else if (max_files > 1 && nr_jobs > 1) {
+                bad = process_files(files, max_files);
+        } else {
+                struct m2n_ctx ctx;
+
+                for (i = 0; i < max_files; i++) {
+                        memset(&ctx, 0, sizeof(ctx));
+                        ctx.fn = files[i];
+                        ctx.out = bin_fp ? bin_fp : stdout;
+                        ctx.nr_jobs = nr_jobs;
+                        if (process_one(&ctx))
+                                bad++;
+                        if (ctx.stop)
+                                exit(0);
+                }
+        }
+        good = max_files - bad;
+        for (i = 0; i < max_files; i++)
                 free(files[i]);
+        if (bin_fp && fclose(bin_fp)) {
+                fprintf(stderr, "[ERROR]: Failed to write %s\n", bin_file);
+                return EXIT_FAILURE;
         }
         free(files);
 